@@ -36,12 +36,10 @@ void SimpleFeedForwardNetwork::train(const vector< vector< double > >& x,
 		for (size_t example = 0; example < trainingexamples; example++)
 		{
 			// propagate the inputs forward to compute the outputs 
-			vector< double > activationInput(inputLayerSize); // We store the activation of each node (over all input and hidden layers) as we need that data during back propagation.			
 			for (size_t inputNode = 0; inputNode < inputLayerSize; inputNode++) // initialize input layer with training data
 			{
 				activationInput[inputNode] = x[example][inputNode];
 			}
-			vector< double > activationHidden(hiddenLayerSize);
 			// calculate activations of hidden layers (for now, just one hidden layer)
 			for (size_t hiddenNode = 0; hiddenNode < hiddenLayerSize; hiddenNode++)
 			{
@@ -66,7 +64,6 @@ void SimpleFeedForwardNetwork::train(const vector< vector< double > >& x,
 
 			// Calculating error of hidden layer. Special calculation since we only have one output node; i.e. no summation over next layer nodes
 			// Also adjusting weights of output layer
-			vector< double > errorOfHiddenNode(hiddenLayerSize);
 			for (size_t hiddenNode = 0; hiddenNode < hiddenLayerSize; hiddenNode++)
 			{
 				errorOfHiddenNode[hiddenNode] = outputLayerWeights[hiddenNode] * errorOfOutputNode;
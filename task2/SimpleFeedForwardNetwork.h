@@ -13,7 +13,8 @@ public:
 		const vector< double >& y, size_t numEpochs);
 
 	SimpleFeedForwardNetwork(double alpha, size_t hiddenLayerSize, size_t inputLayerSize) :
-		alpha(alpha), hiddenLayerSize(hiddenLayerSize), inputLayerSize(inputLayerSize) {}
+		alpha(alpha), hiddenLayerSize(hiddenLayerSize), inputLayerSize(inputLayerSize),
+		activationInput(inputLayerSize), activationHidden(hiddenLayerSize), errorOfHiddenNode(hiddenLayerSize) {}
 
 private:
 	vector< vector< double > > hiddenLayerWeights; // [from][to]
@@ -23,6 +24,12 @@ private:
 	size_t hiddenLayerSize;
 	size_t inputLayerSize;
 
+	// scratch for the current example, sized once so training never allocates. We store
+	// the activation of each node (over all input and hidden layers) as we need that data
+	// during back propagation.
+	vector< double > activationInput;
+	vector< double > activationHidden;
+	vector< double > errorOfHiddenNode;
 
 	inline double g(double x) {return 1.0 / (1.0 + exp(-x)); }
 	inline double gprime(double y) {return y * (1 - y); }
@@ -0,0 +1,159 @@
+#include "AllocationCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Kept in their own translation unit: where the callers of operator new can see
+// that operator delete is free(), GCC warns about the mismatch.
+
+static atomic<bool> counting(false);
+static atomic<size_t> nAllocations(0);
+
+void startCountingAllocations() {
+	nAllocations = 0;
+	counting = true;
+}
+
+size_t stopCountingAllocations() {
+	counting = false;
+	return nAllocations;
+}
+
+/**
+ * @brief      Count an allocation and make it, calling the new handler until it
+ *             succeeds as operator new must.
+ */
+static void * allocate(size_t size) {
+	if (counting) {
+		++nAllocations;
+	}
+	for (;;) {
+		if (void * p = malloc(size ? size : 1)) {
+			return p;
+		}
+		new_handler handler = get_new_handler();
+		if (!handler) {
+			throw bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void * allocateNoThrow(size_t size) noexcept {
+	try {
+		return allocate(size);
+	} catch (const bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void * operator new(size_t size) {
+	return allocate(size);
+}
+
+void * operator new[](size_t size) {
+	return allocate(size);
+}
+
+void * operator new(size_t size, const nothrow_t &) noexcept {
+	return allocateNoThrow(size);
+}
+
+void * operator new[](size_t size, const nothrow_t &) noexcept {
+	return allocateNoThrow(size);
+}
+
+void operator delete(void * p) noexcept {
+	free(p);
+}
+
+void operator delete[](void * p) noexcept {
+	free(p);
+}
+
+void operator delete(void * p, const nothrow_t &) noexcept {
+	free(p);
+}
+
+void operator delete[](void * p, const nothrow_t &) noexcept {
+	free(p);
+}
+
+#if __cpp_sized_deallocation
+void operator delete(void * p, size_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept {
+	free(p);
+}
+#endif
+
+#if __cpp_aligned_new
+static void * allocateAligned(size_t size, align_val_t alignment) {
+	if (counting) {
+		++nAllocations;
+	}
+	size_t align = static_cast<size_t>(alignment);
+	// aligned_alloc needs a multiple of the alignment
+	size_t rounded = ((size ? size : 1) + align - 1) / align * align;
+	for (;;) {
+		if (void * p = aligned_alloc(align, rounded)) {
+			return p;
+		}
+		new_handler handler = get_new_handler();
+		if (!handler) {
+			throw bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void * allocateAlignedNoThrow(size_t size, align_val_t alignment) noexcept {
+	try {
+		return allocateAligned(size, alignment);
+	} catch (const bad_alloc &) {
+		return nullptr;
+	}
+}
+
+void * operator new(size_t size, align_val_t alignment) {
+	return allocateAligned(size, alignment);
+}
+
+void * operator new[](size_t size, align_val_t alignment) {
+	return allocateAligned(size, alignment);
+}
+
+void * operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept {
+	return allocateAlignedNoThrow(size, alignment);
+}
+
+void * operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept {
+	return allocateAlignedNoThrow(size, alignment);
+}
+
+void operator delete(void * p, align_val_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void * p, align_val_t) noexcept {
+	free(p);
+}
+
+void operator delete(void * p, align_val_t, const nothrow_t &) noexcept {
+	free(p);
+}
+
+void operator delete[](void * p, align_val_t, const nothrow_t &) noexcept {
+	free(p);
+}
+
+void operator delete(void * p, size_t, align_val_t) noexcept {
+	free(p);
+}
+
+void operator delete[](void * p, size_t, align_val_t) noexcept {
+	free(p);
+}
+#endif
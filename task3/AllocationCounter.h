@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+
+using namespace std;
+
+/* AllocationCounter.cpp replaces every global operator new and delete with ones that
+ * count, so it is only linked into the allocation check (task3_allocation_check), not
+ * into task3. */
+
+/**
+ * @brief      Start counting heap allocations from zero.
+ */
+void startCountingAllocations();
+
+/**
+ * @brief      Stop counting heap allocations.
+ *
+ * @return     The number of allocations since #startCountingAllocations, on any thread.
+ */
+size_t stopCountingAllocations();
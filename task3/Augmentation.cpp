@@ -0,0 +1,97 @@
+#include "Augmentation.h"
+#include "Random.h"
+#include <algorithm>
+#include <cmath>
+
+constexpr double PI = 3.14159265358979323846;
+
+/* The elastic displacement field is interpolated from a coarse grid of random
+ * displacements, which keeps it smooth without a convolution. */
+constexpr size_t ELASTIC_GRID = 4;
+
+Augmentation::Augmentation(double maxShift, double maxRotation, double elasticity, double noise)
+	: maxShift(maxShift)
+	, maxRotation(maxRotation)
+	, elasticity(elasticity)
+	, noise(noise)
+{}
+
+bool Augmentation::enabled() const {
+	return maxShift > 0.0 || maxRotation > 0.0 || elasticity > 0.0 || noise > 0.0;
+}
+
+// a uniform value on [-range, range]
+static double symmetric(uint64_t key, uint64_t counter, double range) {
+	return range * (2.0 * counterUniform(key, counter) - 1.0);
+}
+
+// bilinear interpolation of a grid x grid field at fractional grid position (u, v)
+static double interpolate(const double * field, double u, double v) {
+	size_t u0 = min((size_t)u, ELASTIC_GRID - 2);
+	size_t v0 = min((size_t)v, ELASTIC_GRID - 2);
+	double fu = u - u0;
+	double fv = v - v0;
+	const double * f = field + u0 * ELASTIC_GRID + v0;
+	return (1 - fu) * ((1 - fv) * f[0] + fv * f[1])
+		+ fu * ((1 - fv) * f[ELASTIC_GRID] + fv * f[ELASTIC_GRID + 1]);
+}
+
+void Augmentation::apply(const uint8_t * in, uint8_t * out, size_t rows, size_t cols, uint64_t key) const {
+	// stream layout: 0-2 affine, then both elastic grids, then one value per pixel of noise
+	double shiftRow = symmetric(key, 0, maxShift);
+	double shiftCol = symmetric(key, 1, maxShift);
+	double angle = symmetric(key, 2, maxRotation) * PI / 180.0;
+	double cosine = cos(angle);
+	double sine = sin(angle);
+
+	double rowField[ELASTIC_GRID * ELASTIC_GRID];
+	double colField[ELASTIC_GRID * ELASTIC_GRID];
+	for (size_t g = 0; g < ELASTIC_GRID * ELASTIC_GRID; ++g) {
+		rowField[g] = symmetric(key, 3 + g, elasticity);
+		colField[g] = symmetric(key, 3 + ELASTIC_GRID * ELASTIC_GRID + g, elasticity);
+	}
+	uint64_t noiseCounter = 3 + 2 * ELASTIC_GRID * ELASTIC_GRID;
+
+	double centerRow = (rows - 1) / 2.0;
+	double centerCol = (cols - 1) / 2.0;
+	double gridScaleRow = (ELASTIC_GRID - 1) / (double)max(rows - 1, (size_t)1);
+	double gridScaleCol = (ELASTIC_GRID - 1) / (double)max(cols - 1, (size_t)1);
+
+	for (size_t r = 0; r < rows; ++r) {
+		for (size_t c = 0; c < cols; ++c) {
+			// where in the source image this output pixel comes from
+			double dr = r - centerRow - shiftRow;
+			double dc = c - centerCol - shiftCol;
+			double sr = centerRow + cosine * dr - sine * dc;
+			double sc = centerCol + sine * dr + cosine * dc;
+			if (elasticity > 0.0) {
+				sr += interpolate(rowField, r * gridScaleRow, c * gridScaleCol);
+				sc += interpolate(colField, r * gridScaleRow, c * gridScaleCol);
+			}
+
+			// bilinear sample, treating everything outside the image as background
+			double fr = floor(sr);
+			double fc = floor(sc);
+			double wr = sr - fr;
+			double wc = sc - fc;
+			long r0 = (long)fr;
+			long c0 = (long)fc;
+
+			double value = 0.0;
+			for (long i = 0; i < 2; ++i) {
+				for (long j = 0; j < 2; ++j) {
+					long rr = r0 + i;
+					long cc = c0 + j;
+					if (rr >= 0 && cc >= 0 && rr < (long)rows && cc < (long)cols) {
+						value += (i ? wr : 1 - wr) * (j ? wc : 1 - wc) * in[rr * cols + cc];
+					}
+				}
+			}
+
+			if (noise > 0.0) {
+				value += symmetric(key, noiseCounter + r * cols + c, noise);
+			}
+			out[r * cols + c] = (uint8_t)min(max(value + 0.5, 0.0), 255.0);
+		}
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * @brief      Random distortions applied to 8-bit training images as they are
+ *             gathered into batches. Every distortion is drawn from a counter-based
+ *             stream keyed by the example and epoch, so an example is distorted the
+ *             same way no matter which thread or batch it lands in.
+ */
+struct Augmentation {
+	/** The largest shift in pixels along each axis. */
+	double maxShift;
+	/** The largest rotation in degrees either way. */
+	double maxRotation;
+	/** The largest displacement in pixels of the smooth elastic distortion. */
+	double elasticity;
+	/** The largest value added to or subtracted from a pixel. */
+	double noise;
+
+	Augmentation(double maxShift = 0.0, double maxRotation = 0.0, double elasticity = 0.0, double noise = 0.0);
+
+	/**
+	 * @return     Whether any distortion is turned on.
+	 */
+	bool enabled() const;
+
+	/**
+	 * @brief      Distort one image. Shift, rotation, and elastic distortion are
+	 *             combined into one displacement per pixel and resampled bilinearly in
+	 *             a single pass, then noise is added.
+	 *
+	 * @param[in]  in    The image
+	 * @param[out] out   The distorted image, which must not overlap \p in
+	 * @param[in]  rows  The number of rows in the image
+	 * @param[in]  cols  The number of columns in the image
+	 * @param[in]  key   The counter-based stream for this example and epoch
+	 */
+	void apply(const uint8_t * in, uint8_t * out, size_t rows, size_t cols, uint64_t key) const;
+};
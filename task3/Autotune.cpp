@@ -0,0 +1,159 @@
+#include "Autotune.h"
+#include "Random.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+// how long each candidate is timed for; it keeps its fastest run
+constexpr double TUNING_SECONDS = 0.02;
+constexpr int TUNING_MIN_RUNS = 3;
+
+#ifndef USE_CBLAS
+// the candidates: examples multiplied together, and inputs per pass (0 for all)
+const size_t TUNING_ROWS[] = { 1, 2, 4, 8 };
+const size_t TUNING_BLOCKS[] = { 0, 64, 128, 256, 512 };
+#endif
+
+/**
+ * @brief      One line of the cache: the CPU, the shape, and the winning tuning.
+ */
+struct CacheEntry {
+	string cpu;
+	size_t m;
+	size_t n;
+	size_t k;
+	GemmTuning tuning;
+};
+
+string hostCpu() {
+	ifstream cpuinfo("/proc/cpuinfo");
+	string line;
+	while (getline(cpuinfo, line)) {
+		if (line.compare(0, 10, "model name") == 0) {
+			size_t colon = line.find(':');
+			if (colon != string::npos && colon + 2 <= line.size()) {
+				return line.substr(colon + 2);
+			}
+		}
+	}
+	return "unknown";
+}
+
+#ifndef USE_CBLAS
+static vector<CacheEntry> readCache(const string & path) {
+	vector<CacheEntry> entries;
+	ifstream file(path);
+	string line;
+	while (getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		// the CPU's name has spaces, so the fields are separated by tabs
+		CacheEntry entry;
+		size_t tab = line.find('\t');
+		istringstream fields(tab == string::npos ? string() : line.substr(tab + 1));
+		entry.cpu = line.substr(0, tab);
+		if (!(fields >> entry.m >> entry.n >> entry.k >> entry.tuning.rows >> entry.tuning.block)) {
+			throw runtime_error("autotuning cache " + path + " has a malformed line: " + line);
+		}
+		entries.push_back(entry);
+	}
+	return entries;
+}
+
+static void writeCache(const string & path, const vector<CacheEntry> & entries) {
+	ofstream file(path, ios::trunc);
+	file << "# cpu\tm n k\trows block, written by autotuneGemm" << endl;
+	for (const CacheEntry & entry : entries) {
+		file << entry.cpu << '\t'
+			 << entry.m << ' ' << entry.n << ' ' << entry.k << '\t'
+			 << entry.tuning.rows << ' ' << entry.tuning.block << endl;
+	}
+	if (!file) {
+		throw runtime_error("could not write the autotuning cache " + path);
+	}
+}
+
+/**
+ * @brief      Time gemm() with each candidate tuning on random matrices of the shape.
+ *
+ * @return     The fastest tuning.
+ */
+static GemmTuning measure(size_t m, size_t n, size_t k) {
+	vector<double> a(m * k);
+	vector<double> b(n * k);
+	vector<double> c(m * n, 0.0);
+	fillUniform(a.data(), a.size(), 1, 0, -1.0, 1.0);
+	fillUniform(b.data(), b.size(), 2, 0, -0.1, 0.1);
+
+	GemmTuning best;
+	double bestSeconds = numeric_limits<double>::infinity();
+	for (size_t r : TUNING_ROWS) {
+		for (size_t block : TUNING_BLOCKS) {
+			if (block >= k) {
+				continue;
+			}
+			GemmTuning tuning(r, block);
+			double fastest = numeric_limits<double>::infinity();
+			double total = 0.0;
+			for (int run = 0; run < TUNING_MIN_RUNS || total < TUNING_SECONDS; ++run) {
+				auto start = chrono::steady_clock::now();
+				gemm(m, n, k, a.data(), b.data(), c.data(), tuning);
+				double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				fastest = min(fastest, seconds);
+				total += seconds;
+			}
+			if (fastest < bestSeconds) {
+				best = tuning;
+				bestSeconds = fastest;
+			}
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief      Is the tuning one gemm() accepts? A cache edited by hand may have others.
+ */
+static bool isValid(const GemmTuning & tuning) {
+	return find(begin(TUNING_ROWS), end(TUNING_ROWS), tuning.rows) != end(TUNING_ROWS);
+}
+#endif
+
+GemmTuning autotuneGemm(size_t m, size_t n, size_t k, const string & cachePath, bool retune) {
+#ifdef USE_CBLAS
+	// the library ignores the tuning, so there is nothing to measure
+	(void)m;
+	(void)n;
+	(void)k;
+	(void)cachePath;
+	(void)retune;
+	return GemmTuning();
+#else
+	string cpu = hostCpu();
+	vector<CacheEntry> entries = readCache(cachePath);
+	for (CacheEntry & entry : entries) {
+		if (entry.cpu == cpu && entry.m == m && entry.n == n && entry.k == k) {
+			if (retune || !isValid(entry.tuning)) {
+				entry.tuning = measure(m, n, k);
+				writeCache(cachePath, entries);
+			}
+			return entry.tuning;
+		}
+	}
+
+	CacheEntry entry;
+	entry.cpu = cpu;
+	entry.m = m;
+	entry.n = n;
+	entry.k = k;
+	entry.tuning = measure(m, n, k);
+	entries.push_back(entry);
+	writeCache(cachePath, entries);
+	return entry.tuning;
+#endif
+}
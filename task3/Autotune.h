@@ -0,0 +1,31 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include "Backend.h"
+
+using namespace std;
+
+/**
+ * @brief      Identify this machine's CPU for the autotuning cache.
+ *
+ * @return     The CPU's model name, or "unknown".
+ */
+string hostCpu();
+
+/**
+ * @brief      Find the fastest GemmTuning for multiplying m examples by a layer of n
+ *             nodes with k inputs on this machine. Every candidate is timed once and the
+ *             winner is kept in a cache file, so later runs on the same CPU only look it
+ *             up. The file holds one line per CPU and shape, so hosts can share it.
+ *             A cached tuning gemm() would reject is timed again. BLAS backends ignore
+ *             the tuning, so with them nothing is timed or cached.
+ *
+ * @param[in]  m          The number of examples
+ * @param[in]  n          The number of nodes
+ * @param[in]  k          The number of inputs
+ * @param[in]  cachePath  The cache file, created if missing
+ * @param[in]  retune     Should the candidates be timed even if the cache has a winner?
+ *
+ * @return     The tuning.
+ */
+GemmTuning autotuneGemm(size_t m, size_t n, size_t k, const string & cachePath, bool retune = false);
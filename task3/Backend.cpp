@@ -0,0 +1,85 @@
+#include "Backend.h"
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef USE_CBLAS
+#include <cblas.h>
+#endif
+
+GemmTuning::GemmTuning(size_t rows, size_t block)
+	: rows(rows)
+	, block(block)
+{}
+
+const char * backendName() {
+#ifdef USE_CBLAS
+	return BLAS_BACKEND_NAME;
+#else
+	return "Portable";
+#endif
+}
+
+/**
+ * @brief      Add inputs [first, last) of R examples to their weighted inputs. The R
+ *             sums of a node don't depend on each other, so they overlap instead of
+ *             each waiting on its previous addition, and each weight is loaded once.
+ */
+template <size_t R>
+static void gemmRows(size_t n, size_t k, size_t first, size_t last, const double * a, const double * b, double * c) {
+	for (size_t j = 0; j < n; ++j) {
+		const double * w = b + j * k;
+		double s[R];
+		for (size_t r = 0; r < R; ++r) {
+			s[r] = c[r * n + j];
+		}
+		for (size_t i = first; i < last; ++i) {
+			for (size_t r = 0; r < R; ++r) {
+				s[r] += w[i] * a[r * k + i];
+			}
+		}
+		for (size_t r = 0; r < R; ++r) {
+			c[r * n + j] = s[r];
+		}
+	}
+}
+
+template <size_t R>
+static void gemmBlocked(size_t m, size_t n, size_t k, const double * a, const double * b, double * c, size_t block) {
+	size_t r = 0;
+	for (; r + R <= m; r += R) {
+		for (size_t first = 0; first < k; first += block) {
+			gemmRows<R>(n, k, first, min(k, first + block), a + r * k, b, c + r * n);
+		}
+	}
+	for (; r < m; ++r) {
+		for (size_t first = 0; first < k; first += block) {
+			gemmRows<1>(n, k, first, min(k, first + block), a + r * k, b, c + r * n);
+		}
+	}
+}
+
+void gemm(size_t m, size_t n, size_t k, const double * a, const double * b, double * c, const GemmTuning & tuning) {
+#ifdef USE_CBLAS
+	(void)tuning;
+	cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, (int)m, (int)n, (int)k,
+		1.0, a, (int)k, b, (int)k, 1.0, c, (int)n);
+#else
+	size_t block = tuning.block == 0 ? max<size_t>(k, 1) : tuning.block;
+	switch (tuning.rows) {
+	case 1:
+		gemmBlocked<1>(m, n, k, a, b, c, block);
+		break;
+	case 2:
+		gemmBlocked<2>(m, n, k, a, b, c, block);
+		break;
+	case 4:
+		gemmBlocked<4>(m, n, k, a, b, c, block);
+		break;
+	case 8:
+		gemmBlocked<8>(m, n, k, a, b, c, block);
+		break;
+	default:
+		throw logic_error("gemm works on 1, 2, 4, or 8 examples at a time");
+	}
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <cstddef>
+
+using namespace std;
+
+/**
+ * @brief      How the portable gemm() walks the matrices. Every choice adds up each
+ *             element in the same order, so it only changes the speed, which depends on
+ *             the host's caches and pipeline. BLAS backends ignore it.
+ */
+struct GemmTuning {
+	/** Examples multiplied together (1, 2, 4, or 8), whose sums overlap. */
+	size_t rows;
+	/** Inputs per pass over the nodes, so the examples' inputs stay in cache; 0 for all. */
+	size_t block;
+
+	GemmTuning(size_t rows = 4, size_t block = 0);
+};
+
+/**
+ * @brief      The name of the backend doing the dense layer math, chosen when configuring
+ *             with -DBLAS_BACKEND=Portable, OpenBLAS, or BLIS (see CMakeLists.txt).
+ *
+ * @return     The name.
+ */
+const char * backendName();
+
+/**
+ * @brief      Multiply a batch of activations by a layer's weights: C += A * B^T, with
+ *             every matrix row-major. The portable backend adds up each element of C in
+ *             the order of NeuralNetwork::in, so its results are the same as one example
+ *             at a time; a BLAS library is faster on wide layers but may round
+ *             differently.
+ *
+ * @param[in]  m       The number of examples, the rows of A and C
+ * @param[in]  n       The number of nodes, the rows of B and columns of C
+ * @param[in]  k       The number of inputs, the columns of A and B
+ * @param[in]  a       The activations, one example per row
+ * @param[in]  b       The weights, one node per row
+ * @param      c       The weighted inputs, one example per row, starting from the biases
+ * @param[in]  tuning  How the portable backend walks the matrices
+ */
+void gemm(size_t m, size_t n, size_t k, const double * a, const double * b, double * c,
+	const GemmTuning & tuning = GemmTuning());
@@ -0,0 +1,203 @@
+#include "BatchLoader.h"
+#include "Random.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <random>
+
+BatchLoader::BatchLoader
+		( const vector<vector<uint8_t>> & images
+		, const vector<double> & labels
+		, size_t batchSize
+		, unsigned ringSize
+		, unsigned nWorkers
+		, const Augmentation & augmentation
+		, bool sparse )
+	: imageSize(images.empty() ? 0 : images[0].size())
+	, nExamples(images.size())
+	, batchSize(batchSize)
+	, nBatches((images.size() + batchSize - 1) / max(batchSize, (size_t)1))
+	, side((size_t)lround(sqrt((double)imageSize)))
+	, augmentation(augmentation)
+	, sparse(sparse)
+	, seed(0)
+	, epoch(0)
+	, labels(labels)
+	, ring(ringSize)
+	, ready(ringSize, false)
+	, nClaimed(0)
+	, nReleased(0)
+	, nInFlight(0)
+	, holding(false)
+	, stopping(false)
+	, stall(0.0)
+{
+	if (batchSize == 0 || ringSize == 0 || nWorkers == 0) {
+		throw logic_error("batch size, ring size, and worker count must be positive");
+	}
+	if (labels.size() != images.size()) {
+		throw logic_error("every image needs a label");
+	}
+	if (augmentation.enabled() && side * side != imageSize) {
+		throw logic_error("augmentation needs square images");
+	}
+
+	// one contiguous copy, so gathering a batch touches as few cache lines as possible
+	pixels.reserve(nExamples * imageSize);
+	for (const vector<uint8_t> & image : images) {
+		if (image.size() != imageSize) {
+			throw logic_error("images must all be the same size");
+		}
+		pixels.insert(pixels.end(), image.begin(), image.end());
+	}
+
+	for (Batch & batch : ring) {
+		batch.pixels.resize(batchSize * imageSize);
+		batch.outputs.resize(batchSize);
+		if (sparse) {
+			batch.sparse.indices.reserve(batchSize * imageSize);
+			batch.sparse.values.reserve(batchSize * imageSize);
+			batch.sparse.offsets.reserve(batchSize + 1);
+		}
+		batch.size = 0;
+		batch.index = 0;
+	}
+
+	order.resize(nExamples);
+	for (size_t i = 0; i < nExamples; ++i) {
+		order[i] = i;
+	}
+	// nothing to produce until the first startEpoch
+	nClaimed = nReleased = nBatches;
+
+	for (unsigned w = 0; w < nWorkers; ++w) {
+		workers.push_back(thread(&BatchLoader::work, this));
+	}
+}
+
+BatchLoader::~BatchLoader() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	workAvailable.notify_all();
+	for (thread & worker : workers) {
+		worker.join();
+	}
+}
+
+void BatchLoader::startEpoch(bool shuffle, unsigned seed, unsigned epoch) {
+	unique_lock<mutex> guard(lock);
+
+	// stop handing out the old epoch and wait for batches still being filled
+	nClaimed = nBatches;
+	batchReady.wait(guard, [this]() { return nInFlight == 0; });
+
+	for (size_t i = 0; i < nExamples; ++i) {
+		order[i] = i;
+	}
+	if (shuffle) {
+		mt19937 generator(seed ^ (epoch * 0x9E3779B9U));
+		for (size_t i = nExamples; i > 1; --i) {
+			uniform_int_distribution<size_t> pick(0, i - 1);
+			swap(order[i - 1], order[pick(generator)]);
+		}
+	}
+
+	this->seed = seed;
+	this->epoch = epoch;
+	fill_n(ready.begin(), ready.size(), false);
+	nClaimed = 0;
+	nReleased = 0;
+	holding = false;
+
+	guard.unlock();
+	workAvailable.notify_all();
+}
+
+const BatchLoader::Batch * BatchLoader::next() {
+	unique_lock<mutex> guard(lock);
+
+	if (holding) {
+		ready[nReleased % ring.size()] = false;
+		++nReleased;
+		holding = false;
+		workAvailable.notify_all();
+	}
+	if (nReleased >= nBatches) {
+		return nullptr;
+	}
+
+	Batch & batch = ring[nReleased % ring.size()];
+	if (!ready[nReleased % ring.size()]) {
+		auto start = chrono::steady_clock::now();
+		batchReady.wait(guard, [this]() { return ready[nReleased % ring.size()]; });
+		stall += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+
+	holding = true;
+	return &batch;
+}
+
+size_t BatchLoader::size() const {
+	return nExamples;
+}
+
+size_t BatchLoader::inputSize() const {
+	return imageSize;
+}
+
+double BatchLoader::stallSeconds() const {
+	return stall;
+}
+
+void BatchLoader::work() {
+	unique_lock<mutex> guard(lock);
+
+	for (;;) {
+		// a batch may only be filled once the batch ring.size() before it is released
+		workAvailable.wait(guard, [this]() {
+			return stopping || (nClaimed < nBatches && nClaimed < nReleased + ring.size());
+		});
+		if (stopping) {
+			return;
+		}
+
+		size_t index = nClaimed++;
+		++nInFlight;
+		guard.unlock();
+
+		fill(index, ring[index % ring.size()]);
+
+		guard.lock();
+		ready[index % ring.size()] = true;
+		--nInFlight;
+		batchReady.notify_all();
+	}
+}
+
+void BatchLoader::fill(size_t index, Batch & batch) {
+	uint64_t epochKey = childKey(seed, epoch);
+
+	size_t first = index * batchSize;
+	batch.size = min(batchSize, nExamples - first);
+	batch.index = index;
+	batch.sparse.clear();
+
+	for (size_t b = 0; b < batch.size; ++b) {
+		size_t example = order[first + b];
+		const uint8_t * image = &pixels[example * imageSize];
+		uint8_t * input = &batch.pixels[b * imageSize];
+
+		if (augmentation.enabled()) {
+			augmentation.apply(image, input, side, side, childKey(epochKey, example));
+		} else {
+			copy(image, image + imageSize, input);
+		}
+		if (sparse) {
+			batch.sparse.append(input, imageSize);
+		}
+		batch.outputs[b] = labels[example];
+	}
+}
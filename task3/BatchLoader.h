@@ -0,0 +1,143 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Augmentation.h"
+#include "SparseImages.h"
+
+using namespace std;
+
+/**
+ * @brief      Assembles batches of training examples on worker threads while the
+ *             previous batches are being trained on. Batches are gathered from 8-bit
+ *             images in a (optionally shuffled) order, optionally distorted, and handed
+ *             out in order through a bounded ring of buffers. Pixels stay 8-bit; the
+ *             network normalizes them as it reads them.
+ */
+class BatchLoader {
+public:
+	/**
+	 * @brief      A batch of examples.
+	 */
+	struct Batch {
+		/** The pixels, one row of imageSize values per example. */
+		vector<uint8_t> pixels;
+		/** The same pixels compressed, if the loader was asked for sparse batches. */
+		SparseImages sparse;
+		/** The expected output of each example. */
+		vector<double> outputs;
+		/** The number of examples in this batch. */
+		size_t size;
+		/** The position of this batch in the epoch. */
+		size_t index;
+	};
+
+	/**
+	 * @brief      Constructs a new loader and starts its worker threads.
+	 *
+	 * @param[in]  images        The training images, which must all be the same size
+	 * @param[in]  labels        The expected output of each image
+	 * @param[in]  batchSize     The number of examples per batch
+	 * @param[in]  ringSize      The number of batch buffers; 2 double-buffers
+	 * @param[in]  nWorkers      The number of threads filling buffers
+	 * @param[in]  augmentation  Distortions applied to each image; the images must
+	 *                           be square if any are enabled
+	 * @param[in]  sparse        Should batches also be compressed into
+	 *                           Batch::sparse?
+	 */
+	BatchLoader
+			( const vector<vector<uint8_t>> & images
+			, const vector<double> & labels
+			, size_t batchSize = 64
+			, unsigned ringSize = 2
+			, unsigned nWorkers = 1
+			, const Augmentation & augmentation = Augmentation()
+			, bool sparse = false );
+
+	~BatchLoader();
+
+	BatchLoader(const BatchLoader &) = delete;
+	BatchLoader & operator=(const BatchLoader &) = delete;
+
+	/**
+	 * @brief      Start producing the batches of a new epoch, abandoning any batches
+	 *             left over from the previous one.
+	 *
+	 * @param[in]  shuffle  Should the examples be visited in a random order?
+	 * @param[in]  seed     The seed for the order and distortions, combined with the
+	 *                      epoch number
+	 * @param[in]  epoch    The epoch number
+	 */
+	void startEpoch(bool shuffle, unsigned seed, unsigned epoch);
+
+	/**
+	 * @brief      Release the batch returned by the last call and wait for the next one.
+	 *
+	 * @return     The next batch, or nullptr once the epoch is finished. Valid until
+	 *             the next call.
+	 */
+	const Batch * next();
+
+	/**
+	 * @return     The number of examples per epoch.
+	 */
+	size_t size() const;
+
+	/**
+	 * @return     The number of pixels in each image.
+	 */
+	size_t inputSize() const;
+
+	/**
+	 * @return     The total time spent waiting in next() for a batch to be ready.
+	 */
+	double stallSeconds() const;
+
+private:
+	size_t imageSize;
+	size_t nExamples;
+	size_t batchSize;
+	size_t nBatches;
+	size_t side;
+
+	Augmentation augmentation;
+	bool sparse;
+	unsigned seed;
+	unsigned epoch;
+
+	vector<uint8_t> pixels;
+	vector<double> labels;
+	vector<size_t> order;
+
+	vector<Batch> ring;
+	vector<bool> ready;
+
+	// batches handed to workers, and released by the consumer, this epoch
+	size_t nClaimed;
+	size_t nReleased;
+	unsigned nInFlight;
+	bool holding;
+	bool stopping;
+
+	double stall;
+
+	mutex lock;
+	condition_variable workAvailable;
+	condition_variable batchReady;
+	vector<thread> workers;
+
+	/**
+	 * @brief      Claim and fill batches until the loader is destroyed.
+	 */
+	void work();
+
+	/**
+	 * @brief      Gather, distort, and compress the examples of one batch.
+	 *
+	 * @param[in]  index      The position of the batch in the epoch
+	 * @param[out] batch      The buffer to fill
+	 */
+	void fill(size_t index, Batch & batch);
+};
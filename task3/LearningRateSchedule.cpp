@@ -0,0 +1,59 @@
+#include "LearningRateSchedule.h"
+#include <algorithm>
+#include <cmath>
+
+constexpr double PI = 3.14159265358979323846;
+
+/* Fraction of a one-cycle schedule spent increasing the rate */
+constexpr double ONE_CYCLE_PEAK = 0.3;
+
+LearningRateSchedule::LearningRateSchedule
+		( Type type
+		, double warmupEpochs
+		, double stepEpochs
+		, double gamma
+		, double minScale )
+	: type(type)
+	, warmupEpochs(warmupEpochs)
+	, stepEpochs(stepEpochs)
+	, gamma(gamma)
+	, minScale(minScale)
+{}
+
+// cosine interpolation from `from` at p = 0 to `to` at p = 1
+static double cosineAnneal(double from, double to, double p) {
+	return to + (from - to) * 0.5 * (1.0 + cos(PI * min(max(p, 0.0), 1.0)));
+}
+
+double LearningRateSchedule::scale(double epoch, double totalEpochs) const {
+	double s = 1.0;
+	double p = totalEpochs > 0.0 ? epoch / totalEpochs : 1.0;
+
+	switch (type) {
+	case Type::Constant:
+		break;
+	case Type::Step:
+		s = pow(gamma, floor(epoch / stepEpochs));
+		break;
+	case Type::Exponential:
+		s = pow(gamma, epoch / stepEpochs);
+		break;
+	case Type::Cosine:
+		s = cosineAnneal(1.0, minScale, p);
+		break;
+	case Type::OneCycle:
+		s = p < ONE_CYCLE_PEAK
+			? cosineAnneal(minScale, 1.0, p / ONE_CYCLE_PEAK)
+			: cosineAnneal(1.0, minScale * 1e-4, (p - ONE_CYCLE_PEAK) / (1.0 - ONE_CYCLE_PEAK));
+		break;
+	}
+
+	if (epoch < warmupEpochs) {
+		s *= epoch / warmupEpochs;
+	}
+	return s;
+}
+
+bool LearningRateSchedule::isConstant() const {
+	return type == Type::Constant && warmupEpochs <= 0.0;
+}
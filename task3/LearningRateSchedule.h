@@ -0,0 +1,60 @@
+#pragma once
+
+using namespace std;
+
+/**
+ * @brief      Scales the learning rate over the course of training. Evaluated once
+ *             per weight update from the (fractional) epoch, so it never allocates.
+ */
+class LearningRateSchedule {
+public:
+	/**
+	 * @brief      The shape of the schedule after warmup.
+	 *
+	 *             - Constant:    1
+	 *             - Step:        gamma ^ floor(epoch / stepEpochs)
+	 *             - Exponential: gamma ^ (epoch / stepEpochs)
+	 *             - Cosine:      anneals from 1 to minScale over all epochs
+	 *             - OneCycle:    rises from minScale to 1 over the first 30% of epochs,
+	 *                            then anneals to minScale / 1e4
+	 */
+	enum class Type { Constant, Step, Exponential, Cosine, OneCycle };
+
+	/**
+	 * @brief      Constructs a new schedule.
+	 *
+	 * @param[in]  type          The shape of the schedule
+	 * @param[in]  warmupEpochs  Epochs over which the rate ramps linearly up from 0
+	 * @param[in]  stepEpochs    Epochs per decay for Step and Exponential
+	 * @param[in]  gamma         The decay factor for Step and Exponential
+	 * @param[in]  minScale      The smallest scale for Cosine and OneCycle
+	 */
+	LearningRateSchedule
+			( Type type = Type::Constant
+			, double warmupEpochs = 0.0
+			, double stepEpochs = 1.0
+			, double gamma = 1.0
+			, double minScale = 0.0 );
+
+	/**
+	 * @brief      The factor to multiply the base learning rate by.
+	 *
+	 * @param[in]  epoch        The number of epochs completed, including fractions
+	 * @param[in]  totalEpochs  The number of epochs in the whole run
+	 *
+	 * @return     The scale.
+	 */
+	double scale(double epoch, double totalEpochs) const;
+
+	/**
+	 * @return     Whether the scale is always 1.
+	 */
+	bool isConstant() const;
+
+private:
+	Type type;
+	double warmupEpochs;
+	double stepEpochs;
+	double gamma;
+	double minScale;
+};
@@ -19,7 +19,8 @@ int reverseInt(int i)
 	return((int)ch1 << 24) + ((int)ch2 << 16) + ((int)ch3 << 8) + ch4;
 }
 
-void loadMnistImages(const string& filename, vector< vector< int > > &images)
+template <typename T>
+void loadMnistImages(const string& filename, vector< vector< T > > &images)
 {
 	ifstream file(filename, ios::binary);
 	if (file.is_open())
@@ -47,7 +48,7 @@ void loadMnistImages(const string& filename, vector< vector< int > > &images)
 				{
 					unsigned char pixel = 0;
 					file.read((char*)&pixel, sizeof(pixel));
-					images[i][n_rows * r + c] = (int)pixel;
+					images[i][n_rows * r + c] = (T)pixel;
 				}
 			}
 		}
@@ -1,15 +1,29 @@
 #include "NeuralNetwork.h"
+#include "Autotune.h"
+#include "Numa.h"
+#include "Random.h"
+#include "util.h"
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
 #include <exception>
+#include <functional>
 #include <iostream>
 #include <iomanip>
+#include <limits>
+#include <cmath>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 
 /* Should we reduce labels to ranges for one output? */
+#ifndef ONE_OUTPUT
 #define ONE_OUTPUT 1
-
-/* Use tanh for activation function? */
-#define USE_TANH 0
+#endif
 
 #if ONE_OUTPUT
 const static vector<double> ranges
@@ -19,61 +33,334 @@ const static vector<double> ranges
 using Node = NeuralNetwork::Node;
 using Layer = NeuralNetwork::Layer;
 
-unsigned Node::number_count = 0;
-
 constexpr double WEIGHT_LOWER_BOUND = -0.5;
 constexpr double WEIGHT_UPPER_BOUND = 0.5;
 
+// normalizePixel() of every 8-bit value, so 8-bit inputs match normalized ones exactly
+static const vector<double> normalizedPixels = []() {
+	vector<double> table(256);
+	for (int value = 0; value < 256; ++value) {
+		table[value] = normalizePixel(value);
+	}
+	return table;
+}();
+
+// keeps dropout masks on a different stream from the weights with the same seed
+constexpr uint64_t DROPOUT_STREAM = 0x44524F504F555400ULL;
+
+// how fast batch normalization's running statistics follow the weighted inputs, and
+// the variance added before taking its root
+constexpr double BATCH_NORM_MOMENTUM = 0.01;
+constexpr double BATCH_NORM_EPSILON = 1e-5;
+
+// getLoss() is LOSS_SCALE * sum((y - o)^2) and each node's error is the derivative of
+// half the unscaled sum, so the loss gradient is -2 * LOSS_SCALE times the SGD step
+constexpr double LOSS_SCALE = 100.0;
+// gradients smaller than this are lost in the rounding of central differences, so
+// checkGradients() does not compare them
+constexpr double NEGLIGIBLE_GRADIENT = 1e-4;
+
+// validation examples handed to a thread at a time
+constexpr size_t VALIDATION_CHUNK = 64;
+
+constexpr char NeuralNetwork::checkpointMagic[4];
+constexpr uint32_t NeuralNetwork::checkpointVersion;
+
+constexpr double LEAKY_RELU_SLOPE = 0.01;
+// sqrt(2 / pi) and the cubic coefficient of the tanh approximation of GELU
+constexpr double GELU_SCALE = 0.7978845608028654;
+constexpr double GELU_CUBIC = 0.044715;
+
 Node::Node(Layer::size_type layerIndex) 
 	: layerIndex(layerIndex)
 	, activation(0.0)
 	, error(0.0)
-{
-	number = ++number_count;
-}
+	, bias(0.0)
+	, biasFirstMoment(0.0)
+	, biasSecondMoment(0.0)
+{}
 
 Node::Node(double activation, Layer::size_type layerIndex)
 	: layerIndex(layerIndex)
 	, activation(activation)
 	, error(0.0)
+	, bias(0.0)
+	, biasFirstMoment(0.0)
+	, biasSecondMoment(0.0)
+{}
+
+NeuralNetwork::EarlyStopping::EarlyStopping(unsigned patience, double minDelta, double targetAccuracy)
+	: patience(patience)
+	, minDelta(minDelta)
+	, targetAccuracy(targetAccuracy)
+{}
+
+NeuralNetwork::OptimizerSettings::OptimizerSettings(Optimizer type, double beta1, double beta2, double epsilon)
+	: type(type)
+	, beta1(beta1)
+	, beta2(beta2)
+	, epsilon(epsilon)
+{}
+
+NeuralNetwork::ConvolutionalLayer::ConvolutionalLayer(Type type, int channels, int kernel, int stride, int padding, Activation activation)
+	: type(type)
+	, channels(channels)
+	, kernel(kernel)
+	, stride(stride)
+	, padding(padding)
+	, activation(activation)
+{}
+
+NeuralNetwork::ConvolutionalStage::ConvolutionalStage(const ConvolutionalLayer & layer, size_t inChannels, size_t inRows, size_t inCols)
+	: layer(layer)
+	, inChannels(inChannels)
+	, inRows(inRows)
+	, inCols(inCols)
 {
-	number = ++number_count;
+	if (layer.kernel <= 0 || layer.stride <= 0 || layer.padding < 0
+			|| (layer.type == ConvolutionalLayer::Type::Convolution && layer.channels <= 0)) {
+		throw logic_error("invalid convolutional layer");
+	}
+
+	size_t k = layer.kernel;
+	size_t pad = layer.type == ConvolutionalLayer::Type::Convolution ? layer.padding : 0;
+	if (inRows + 2 * pad < k || inCols + 2 * pad < k) {
+		throw logic_error("convolutional layer kernel larger than its input");
+	}
+	outRows = (inRows + 2 * pad - k) / layer.stride + 1;
+	outCols = (inCols + 2 * pad - k) / layer.stride + 1;
+
+	size_t positions = outRows * outCols;
+	size_t outChannels = inChannels;
+	if (layer.type == ConvolutionalLayer::Type::Convolution) {
+		outChannels = layer.channels;
+		weights.resize(outChannels * inChannels * k * k);
+		biases.resize(outChannels);
+		columns.resize(inChannels * k * k * positions);
+		columnErrors.resize(columns.size());
+		derivatives.resize(outChannels * positions);
+	} else {
+		this->layer.channels = inChannels;
+		if (layer.type == ConvolutionalLayer::Type::MaxPool) {
+			sources.resize(outChannels * positions);
+		}
+	}
+	netInputs.resize(outChannels * positions);
+	activations.resize(netInputs.size());
+	errors.resize(netInputs.size());
 }
 
-NeuralNetwork::NeuralNetwork(int nInputs, int nHiddenLayers, int hiddenLayerSize, int nOutputs) 
-	: nOutputs(nOutputs)
+NeuralNetwork::NeuralNetwork(int nInputs, int nHiddenLayers, int hiddenLayerSize, int nOutputs, bool useBias) 
+	: NeuralNetwork(uniformTopology(nInputs, nHiddenLayers, hiddenLayerSize, nOutputs), useBias)
+{}
+
+NeuralNetwork::NeuralNetwork(const vector<int> & topology, bool useBias)
+	: currentEpoch(0)
+	, useBias(useBias)
+	, optimizerStep(0)
+	, nThreads(1)
+	, deterministic(true)
+	, pinThreads(false)
+	, shardFirst(0)
+	, validationRound(0)
+	, stopValidation(false)
+	, nCopying(0)
+	, nValidating(0)
+	, validationChunks(0)
+	, validationWorkers(1)
+	, nextValidationChunk(0)
+	, checkingGradients(false)
+	, currentInput(nullptr)
+	, currentPixels(nullptr)
+	, examplesPerEpoch(0)
+	, batchSize(64)
+	, ringSize(2)
+	, nLoaderWorkers(1)
+	, shuffle(true)
+	, sparseInput(false)
+	, currentIndices(nullptr)
+	, currentValues(nullptr)
+	, currentNonzeros(0)
+	, sparseInputSum(0.0)
+	, fusingFirstLayer(false)
+	, firstLayerPending(false)
+	, pendingAlpha(0.0)
 	, distribution(WEIGHT_LOWER_BOUND, WEIGHT_UPPER_BOUND)
+	, hasStoppedEarly(false)
 {
 	// network = { input, hidden1, hidden2, ..., hiddenN, output }
 
-	Layer inputLayer;
-	for (int n = 0; n < nInputs; ++n) {
-		inputLayer.push_back(Node(n));
+	if (topology.size() < 2) {
+		throw logic_error("topology needs at least an input and an output layer");
 	}
-	network.push_back(inputLayer);
 
-	for (int l = 0; l < nHiddenLayers; ++l) {
-		Layer hiddenLayer;
-		for (int n = 0; n < hiddenLayerSize; ++n) {
-			hiddenLayer.push_back(Node(n));
+	for (int width : topology) {
+		if (width <= 0) {
+			throw logic_error("every layer needs at least one node");
 		}
-		network.push_back(hiddenLayer);
-	}
 
-	Layer outputLayer;
-	for (int n = 0; n < nOutputs; ++n) {
-		outputLayer.push_back(Node(n));
+		Layer layer;
+		for (int n = 0; n < width; ++n) {
+			layer.push_back(Node(n));
+		}
+		network.push_back(layer);
 	}
-	network.push_back(outputLayer);
+	nOutputs = outputLayer().size();
 
 	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
 		for (Layer::size_type n = 0; n < network[l].size(); ++n) {
 			network[l][n].weights.resize(network[l-1].size());
 		}
 	}
+
+	activations.assign(network.size(), Activation::Sigmoid);
+	batchNorms.resize(network.size());
+	dropoutRates.assign(network.size(), 0.0);
+	dropoutMasks.resize(network.size());
+	droppedActivations.resize(network.size());
+	weightInits.assign(network.size(), WeightInit::Auto);
+	layerTunings.resize(network.size());
+
+	vector<Layer>::size_type widest = 0;
+	for (vector<Layer>::size_type l = 0; l < network.size(); ++l) {
+		netInputs.push_back(vector<double>(network[l].size()));
+		layerActivations.push_back(vector<double>(network[l].size()));
+		layerWeights.push_back(vector<double>(l > 0 ? network[l].size() * network[l-1].size() : 0));
+		batchActivations.push_back(vector<double>(VALIDATION_CHUNK * network[l].size()));
+		widest = max(widest, network[l].size());
+	}
+	layerDerivatives.resize(widest);
+	layerErrorSums.resize(widest);
+	sparseShifts.resize(network[1].size());
+	sparseRowSums.resize(network[1].size());
+	sparseInputs.resize(inputLayer().size());
+	pendingInputs.resize(inputLayer().size());
+}
+
+vector<int> NeuralNetwork::uniformTopology(int nInputs, int nHiddenLayers, int hiddenLayerSize, int nOutputs) {
+	vector<int> topology(1, nInputs);
+	topology.insert(topology.end(), nHiddenLayers, hiddenLayerSize);
+	topology.push_back(nOutputs);
+	return topology;
+}
+
+vector<int> NeuralNetwork::parseTopology(const string & description) {
+	vector<int> topology;
+	istringstream stream(description);
+	string width;
+	while (getline(stream, width, '-')) {
+		size_t parsed = 0;
+		try {
+			topology.push_back(stoi(width, &parsed));
+		} catch (const exception &) {
+			parsed = 0;
+		}
+		if (parsed == 0 || parsed != width.size()) {
+			throw logic_error("invalid topology \"" + description + "\"");
+		}
+	}
+	return topology;
+}
+
+vector<int> NeuralNetwork::getTopology() const {
+	vector<int> topology;
+	for (const Layer & layer : network) {
+		topology.push_back(layer.size());
+	}
+	return topology;
+}
+
+vector<NeuralNetwork::ConvolutionalLayer> NeuralNetwork::parseConvolution(const string & description, Activation activation) {
+	vector<ConvolutionalLayer> layers;
+	istringstream stream(description);
+	string token;
+	while (getline(stream, token, '-')) {
+		ConvolutionalLayer layer(ConvolutionalLayer::Type::Convolution, 0, 0, 0, 0, activation);
+		size_t position = 0;
+		if (token.compare(0, 4, "conv") == 0) {
+			position = 4;
+		} else if (token.compare(0, 3, "max") == 0) {
+			layer.type = ConvolutionalLayer::Type::MaxPool;
+			position = 3;
+		} else if (token.compare(0, 3, "avg") == 0) {
+			layer.type = ConvolutionalLayer::Type::AvgPool;
+			position = 3;
+		} else {
+			throw logic_error("invalid convolution \"" + description + "\"");
+		}
+		bool isConvolution = layer.type == ConvolutionalLayer::Type::Convolution;
+
+		// the leading number is the channels of a convolution or the size of a pool,
+		// and each later number is named by the letter before it
+		char name = isConvolution ? 'c' : 'k';
+		while (position < token.size()) {
+			size_t parsed = 0;
+			int value = 0;
+			try {
+				value = stoi(token.substr(position), &parsed);
+			} catch (const exception &) {
+				parsed = 0;
+			}
+			if (parsed == 0 || !isdigit((unsigned char)token[position])) {
+				throw logic_error("invalid convolution \"" + description + "\"");
+			}
+			position += parsed;
+
+			switch (name) {
+			case 'c': layer.channels = value; break;
+			case 'k': layer.kernel = value; break;
+			case 's': layer.stride = value; break;
+			case 'p': layer.padding = value; break;
+			default: throw logic_error("invalid convolution \"" + description + "\"");
+			}
+
+			if (position < token.size()) {
+				name = token[position++];
+				if (!isConvolution && name == 'p') {
+					throw logic_error("pooling layers have no padding in \"" + description + "\"");
+				}
+			}
+		}
+		if (layer.stride == 0) {
+			layer.stride = isConvolution ? 1 : layer.kernel;
+		}
+		layers.push_back(layer);
+	}
+	return layers;
 }
 
-NeuralNetwork::~NeuralNetwork() = default;
+int NeuralNetwork::convolutionOutputSize(int rows, int cols, const vector<ConvolutionalLayer> & layers) {
+	size_t channels = 1;
+	size_t size = rows * cols;
+	for (const ConvolutionalLayer & layer : layers) {
+		ConvolutionalStage stage(layer, channels, rows, cols);
+		rows = stage.outRows;
+		cols = stage.outCols;
+		channels = stage.layer.channels;
+		size = stage.activations.size();
+	}
+	return size;
+}
+
+void NeuralNetwork::setConvolution(int rows, int cols, const vector<ConvolutionalLayer> & layers) {
+	if (convolutionOutputSize(rows, cols, layers) != (int)inputLayer().size()) {
+		throw logic_error("the input layer width does not match the convolution output");
+	}
+
+	convolution.clear();
+	size_t channels = 1;
+	for (const ConvolutionalLayer & layer : layers) {
+		convolution.push_back(ConvolutionalStage(layer, channels, rows, cols));
+		rows = convolution.back().outRows;
+		cols = convolution.back().outCols;
+		channels = convolution.back().layer.channels;
+	}
+	imageInputs.assign(layers.empty() ? 0 : convolution.front().inRows * convolution.front().inCols, 0.0);
+}
+
+NeuralNetwork::~NeuralNetwork() {
+	stopValidationThreads();
+}
 
 void NeuralNetwork::initialize
 		( double alpha
@@ -87,19 +374,233 @@ void NeuralNetwork::initialize
 		)
 {
 	this->alpha = alpha;
+	this->currentAlpha = alpha;
 	this->exampleInputs = exampleInputs;
+	this->examplesPerEpoch = exampleInputs.size();
+	this->loader.reset();
 	this->exampleOutputs = exampleOutputs;
 	this->validationInputs = validationInputs;
+	this->validationPixels.clear();
+	this->validationSparse.clear();
 	this->validationOutputs = validationOutputs;
 	this->epochs = epochs;
+	// the validation threads are idle between rounds, so their shards of the old set
+	// can go
+	for (unique_ptr<NeuralNetwork> & replica : replicas) {
+		if (replica) {
+			replica->shardPixels.clear();
+		}
+	}
 
+	this->seed = seed;
 	generator.seed(seed);
 
 	if (shouldInitWeights) {
 		initWeights();
+		resetOptimizerState();
+	}
+}
+
+void NeuralNetwork::initialize
+		( double alpha
+		, unsigned seed
+		, const vector<vector<uint8_t>> & exampleImages
+		, const vector<double> & exampleOutputs
+		, const vector<vector<uint8_t>> & validationImages
+		, const vector<double> & validationOutputs 
+		, unsigned epochs
+		, bool shouldInitWeights // defaults to true
+		)
+{
+	initialize(alpha, seed, vector<vector<double>>(), vector<double>(),
+		vector<vector<double>>(), validationOutputs, epochs, shouldInitWeights);
+
+	if (sparseInput && optimizer.type != Optimizer::SGD) {
+		throw logic_error("the sparse input path only supports SGD");
+	}
+	if (sparseInput && !convolution.empty()) {
+		throw logic_error("the sparse input path does not support convolution");
+	}
+
+	for (const vector<uint8_t> & image : validationImages) {
+		if (image.size() != imageSize()) {
+			throw logic_error("validation image size does not match the input layer");
+		}
+		if (sparseInput) {
+			validationSparse.append(image.data(), image.size());
+		} else {
+			validationPixels.insert(validationPixels.end(), image.begin(), image.end());
+		}
+	}
+	if (sparseInput) {
+		materializeSparseWeights();
+	}
+
+	if (!exampleImages.empty()) {
+		loader.reset(new BatchLoader(exampleImages, exampleOutputs, batchSize, ringSize, nLoaderWorkers, augmentation, sparseInput));
+		if (loader->inputSize() != imageSize()) {
+			throw logic_error("training image size does not match the input layer");
+		}
+		examplesPerEpoch = loader->size();
+	}
+}
+
+void NeuralNetwork::setBatchPipeline(size_t batchSize, unsigned ringSize, unsigned nWorkers, bool shuffle) {
+	this->batchSize = batchSize;
+	this->ringSize = ringSize;
+	this->nLoaderWorkers = nWorkers;
+	this->shuffle = shuffle;
+}
+
+void NeuralNetwork::setAugmentation(const Augmentation & augmentation) {
+	this->augmentation = augmentation;
+}
+
+void NeuralNetwork::setThreads(unsigned nThreads, bool deterministic, bool pinned) {
+	this->nThreads = max(nThreads, 1u);
+	this->deterministic = deterministic;
+	// the threads are pinned when they start, so start them again
+	stopValidationThreads();
+	pinThreads = pinned;
+	workerCpus = pinned ? spreadCpus(this->nThreads - 1) : vector<int>();
+}
+
+vector<GemmTuning> NeuralNetwork::autotune(const string & cachePath, bool retune) {
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		layerTunings[l] = autotuneGemm(VALIDATION_CHUNK, network[l].size(), network[l-1].size(), cachePath, retune);
+	}
+	return vector<GemmTuning>(layerTunings.begin() + 1, layerTunings.end());
+}
+
+void NeuralNetwork::setSparseInput(bool sparse) {
+	sparseInput = sparse;
+}
+
+void NeuralNetwork::setEarlyStopping(const EarlyStopping & criteria) {
+	earlyStopping = criteria;
+}
+
+void NeuralNetwork::setOptimizer(const OptimizerSettings & settings) {
+	if (sparseInput && settings.type != Optimizer::SGD) {
+		throw logic_error("the sparse input path only supports SGD");
+	}
+	optimizer = settings;
+	resetOptimizerState();
+}
+
+void NeuralNetwork::setActivation(vector<int>::size_type layer, Activation activation) {
+	if (layer == 0 || layer >= network.size()) {
+		throw logic_error("the input layer has no activation function");
+	}
+	activations[layer] = activation;
+}
+
+void NeuralNetwork::setActivations(Activation hidden, Activation output) {
+	for (vector<Layer>::size_type l = 1; l + 1 < network.size(); ++l) {
+		activations[l] = hidden;
+	}
+	activations.back() = output;
+}
+
+void NeuralNetwork::setWeightInit(vector<int>::size_type layer, WeightInit init) {
+	if (layer == 0 || layer >= network.size()) {
+		throw logic_error("the input layer has no weights");
+	}
+	weightInits[layer] = init;
+}
+
+void NeuralNetwork::setWeightInit(WeightInit init) {
+	weightInits.assign(network.size(), init);
+}
+
+void NeuralNetwork::setBatchNorm(vector<int>::size_type layer, bool enabled) {
+	if (layer == 0 || layer + 1 >= network.size()) {
+		throw logic_error("only hidden layers have batch normalization");
+	}
+	size_t n = enabled ? network[layer].size() : 0;
+	BatchNorm & norm = batchNorms[layer];
+	norm.gamma.assign(n, 1.0);
+	norm.beta.assign(n, 0.0);
+	norm.mean.assign(n, 0.0);
+	norm.variance.assign(n, 1.0);
+	norm.normalized.assign(n, 0.0);
+	norm.scale.assign(n, 0.0);
+	norm.errors.assign(n, 0.0);
+}
+
+void NeuralNetwork::setBatchNorm(bool enabled) {
+	for (vector<Layer>::size_type l = 1; l + 1 < network.size(); ++l) {
+		setBatchNorm(l, enabled);
+	}
+}
+
+void NeuralNetwork::foldBatchNorm() {
+	// gamma * (w . a + b - mean) / sqrt(variance) + beta is a layer with weights
+	// w * gamma / sqrt(variance) and the bias below
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		BatchNorm & norm = batchNorms[l];
+		if (norm.gamma.empty()) {
+			continue;
+		}
+
+		for (Node & node : network[l]) {
+			size_t j = node.layerIndex;
+			double scale = norm.gamma[j] / sqrt(norm.variance[j] + BATCH_NORM_EPSILON);
+			for (double & weight : node.weights) {
+				weight *= scale;
+			}
+			if (l == 1 && sparseInput) {
+				sparseShifts[j] *= scale;
+			}
+			node.bias = (node.bias - norm.mean[j]) * scale + norm.beta[j];
+		}
+		setBatchNorm(l, false);
+	}
+	if (sparseInput) {
+		materializeSparseWeights();
+	}
+}
+
+void NeuralNetwork::setDropout(vector<int>::size_type layer, double rate) {
+	if (layer == 0 || layer + 1 >= network.size()) {
+		throw logic_error("only hidden layers have dropout");
+	}
+	if (!(rate >= 0.0 && rate < 1.0)) {
+		throw logic_error("dropout rate must be in [0, 1)");
+	}
+	dropoutRates[layer] = rate;
+	dropoutMasks[layer].assign(rate > 0.0 ? network[layer].size() : 0, 0.0);
+	droppedActivations[layer].assign(dropoutMasks[layer].size(), 0.0);
+}
+
+void NeuralNetwork::setDropout(double rate) {
+	for (vector<Layer>::size_type l = 1; l + 1 < network.size(); ++l) {
+		setDropout(l, rate);
 	}
 }
 
+void NeuralNetwork::setLearningRateSchedule(const LearningRateSchedule & schedule) {
+	this->schedule = schedule;
+}
+
+void NeuralNetwork::resetOptimizerState() {
+	bool needsFirst = optimizer.type == Optimizer::Momentum
+		|| optimizer.type == Optimizer::Nesterov
+		|| optimizer.type == Optimizer::Adam;
+	bool needsSecond = optimizer.type == Optimizer::RMSProp
+		|| optimizer.type == Optimizer::Adam;
+
+	for (auto layerIterator = hiddenLayerBegin(); layerIterator != network.end(); ++layerIterator) {
+		for (Node & node : *layerIterator) {
+			node.firstMoment.assign(needsFirst ? node.weights.size() : 0, 0.0);
+			node.secondMoment.assign(needsSecond ? node.weights.size() : 0, 0.0);
+			node.biasFirstMoment = 0.0;
+			node.biasSecondMoment = 0.0;
+		}
+	}
+	optimizerStep = 0;
+}
+
 void NeuralNetwork::showTrainingResult(int precision) {
 	calcTotals();
 	cout << setprecision(precision)
@@ -120,22 +621,66 @@ void NeuralNetwork::showValidationResult(int precision) {
 
 void NeuralNetwork::trainAndValidate(int precision) {
 	currentEpoch = 0;
+	resetEarlyStopping();
 
 	do {
-		++currentEpoch;
-		trainSingleEpoch();
-		validate();
-
-		calcTotals();
+		trainAndValidateSingleEpoch();
 
 		cout << setprecision(precision)
 			 << "epoch: " << currentEpoch << ", "
 			 << "trainAccuracy: " << trainAccuracy << ", "
 			 << "trainLoss: " << trainLoss << ", "
 			 << "valAccuracy: " << valAccuracy << ", "
-			 << "valLoss: " << valLoss
-			 << endl;
-	} while (currentEpoch < epochs);
+			 << "valLoss: " << valLoss << ", ";
+
+		ios::fmtflags flags = cout.flags();
+		cout << scientific << "alpha: " << currentAlpha << endl;
+		cout.flags(flags);
+	} while (currentEpoch < epochs && !hasStoppedEarly);
+
+	if (hasStoppedEarly) {
+		cout << "stopped early (epoch " << currentEpoch << ")" << endl;
+	}
+	if (loader) {
+		cout << "time spent waiting for batches: " << loader->stallSeconds() << "s" << endl;
+	}
+}
+
+unsigned NeuralNetwork::continueTraining(unsigned nEpochs) {
+	if (currentEpoch == 0) {
+		resetEarlyStopping();
+	}
+
+	unsigned ran = 0;
+	while (ran < nEpochs && !hasStoppedEarly) {
+		trainAndValidateSingleEpoch();
+		++ran;
+	}
+	return ran;
+}
+
+void NeuralNetwork::trainAndValidateSingleEpoch() {
+	++currentEpoch;
+	trainSingleEpoch();
+	validate();
+
+	calcTotals();
+
+	if (valLoss < bestValLoss - earlyStopping.minDelta) {
+		bestValLoss = valLoss;
+		epochsSinceImprovement = 0;
+	} else {
+		++epochsSinceImprovement;
+	}
+
+	hasStoppedEarly = valAccuracy >= earlyStopping.targetAccuracy
+		|| (earlyStopping.patience > 0 && epochsSinceImprovement >= earlyStopping.patience);
+}
+
+void NeuralNetwork::resetEarlyStopping() {
+	bestValLoss = numeric_limits<double>::infinity();
+	epochsSinceImprovement = 0;
+	hasStoppedEarly = false;
 }
 
 void NeuralNetwork::train() {
@@ -151,22 +696,309 @@ void NeuralNetwork::trainSingleEpoch() {
 	totalTrainSamples = 0;
 	totalCorrectTrainSamples = 0;
 	totalTrainLoss = 0.0;
+	fusingFirstLayer = optimizer.type == Optimizer::SGD && convolution.empty() && !sparseInput;
 
-	for (vector<vector<double>>::size_type i = 0; i < exampleInputs.size(); ++i) {
-		currentInput = &exampleInputs[i];
-		currentOutput = &exampleOutputs[i];
+	if (loader) {
+		// the next batches are assembled in the background while this one trains
+		loader->startEpoch(shuffle, seed, currentEpoch);
+		while (const BatchLoader::Batch * batch = loader->next()) {
+			size_t inputSize = imageSize();
+			const SparseImages & sparse = batch->sparse;
+			for (size_t b = 0; b < batch->size; ++b) {
+				if (sparseInput) {
+					currentIndices = &sparse.indices[sparse.offsets[b]];
+					currentValues = &sparse.values[sparse.offsets[b]];
+					currentNonzeros = sparse.offsets[b+1] - sparse.offsets[b];
+				} else {
+					currentPixels = &batch->pixels[b * inputSize];
+				}
+				currentOutput = &batch->outputs[b];
+				trainCurrentExample();
+			}
+		}
+		currentPixels = nullptr;
+		currentIndices = nullptr;
+		if (sparseInput) {
+			materializeSparseWeights();
+		}
+	} else {
+		for (vector<vector<double>>::size_type i = 0; i < exampleInputs.size(); ++i) {
+			currentInput = exampleInputs[i].data();
+			currentOutput = &exampleOutputs[i];
+			trainCurrentExample();
+		}
+	}
+
+	applyPendingUpdate();
+	fusingFirstLayer = false;
+}
 
-		forwardPropagate();
-		totalTrainLoss += getLoss();
+void NeuralNetwork::trainCurrentExample() {
+	forwardPropagate(true);
+	totalTrainLoss += getLoss();
 
-		backwardPropagate();
-		updateWeights();
+	backwardPropagate();
 
-		if (getPredictedLabel() == (int)*currentOutput) {
-			++totalCorrectTrainSamples;
+	if (getPredictedLabel() == (int)*currentOutput) {
+		++totalCorrectTrainSamples;
+	}
+	++totalTrainSamples;
+}
+
+double NeuralNetwork::checkGradients(const vector<uint8_t> & image, double output, double epsilon) {
+	if (image.size() != imageSize()) {
+		throw logic_error("image size does not match the input layer");
+	}
+
+	SparseImages sparse;
+	if (sparseInput) {
+		sparse.append(image.data(), image.size());
+		currentIndices = sparse.indices.data();
+		currentValues = sparse.values.data();
+		currentNonzeros = sparse.indices.size();
+		materializeSparseWeights();
+	} else {
+		currentPixels = image.data();
+	}
+	currentOutput = &output;
+
+	// every parameter, and for the first layer's weights on the sparse input path the
+	// row sum that has to move with it
+	vector<double *> parameters;
+	vector<double *> rowSums;
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		for (Node & node : network[l]) {
+			for (double & weight : node.weights) {
+				parameters.push_back(&weight);
+				rowSums.push_back(l == 1 && sparseInput ? &sparseRowSums[node.layerIndex] : nullptr);
+			}
+			if (useBias) {
+				parameters.push_back(&node.bias);
+				rowSums.push_back(nullptr);
+			}
+		}
+	}
+	for (ConvolutionalStage & stage : convolution) {
+		for (double & weight : stage.weights) {
+			parameters.push_back(&weight);
+		}
+		for (double & bias : stage.biases) {
+			parameters.push_back(&bias);
+		}
+	}
+	for (BatchNorm & norm : batchNorms) {
+		for (size_t j = 0; j < norm.gamma.size(); ++j) {
+			parameters.push_back(&norm.gamma[j]);
+			parameters.push_back(&norm.beta[j]);
+		}
+	}
+	rowSums.resize(parameters.size(), nullptr);
+
+	checkingGradients = true;
+
+	vector<double> numeric(parameters.size());
+	for (size_t p = 0; p < parameters.size(); ++p) {
+		double original = *parameters[p];
+		double originalSum = rowSums[p] ? *rowSums[p] : 0.0;
+
+		*parameters[p] = original + epsilon;
+		if (rowSums[p]) {
+			*rowSums[p] = originalSum + epsilon;
+		}
+		forwardPropagate(true);
+		double lossPlus = getLoss();
+
+		*parameters[p] = original - epsilon;
+		if (rowSums[p]) {
+			*rowSums[p] = originalSum - epsilon;
 		}
-		++totalTrainSamples;
+		forwardPropagate(true);
+		double lossMinus = getLoss();
+
+		*parameters[p] = original;
+		if (rowSums[p]) {
+			*rowSums[p] = originalSum;
+		}
+		numeric[p] = (lossPlus - lossMinus) / (2.0 * epsilon);
+	}
+
+	// one SGD step with a learning rate of 1 moves each parameter by its gradient
+	vector<double> before(parameters.size());
+	for (size_t p = 0; p < parameters.size(); ++p) {
+		before[p] = *parameters[p];
 	}
+	vector<double> shiftsBefore = sparseShifts;
+	vector<double> rowSumsBefore = sparseRowSums;
+	OptimizerSettings savedOptimizer = optimizer;
+	LearningRateSchedule savedSchedule = schedule;
+	double savedAlpha = alpha;
+	double savedCurrentAlpha = currentAlpha;
+	optimizer.type = Optimizer::SGD;
+	schedule = LearningRateSchedule();
+	alpha = currentAlpha = 1.0;
+
+	forwardPropagate(true);
+	backwardPropagate();
+	--optimizerStep;
+
+	double worst = 0.0;
+	for (size_t p = 0; p < parameters.size(); ++p) {
+		double after = *parameters[p];
+		if (rowSums[p]) {
+			// the actual weight includes its node's shift
+			after += sparseShifts[rowSums[p] - sparseRowSums.data()];
+		}
+		double analytic = -2.0 * LOSS_SCALE * (after - before[p]);
+		double scale = fabs(numeric[p]) + fabs(analytic);
+		if (scale > NEGLIGIBLE_GRADIENT) {
+			worst = max(worst, fabs(numeric[p] - analytic) / scale);
+		}
+		*parameters[p] = before[p];
+	}
+	sparseShifts = shiftsBefore;
+	sparseRowSums = rowSumsBefore;
+	optimizer = savedOptimizer;
+	schedule = savedSchedule;
+	alpha = savedAlpha;
+	currentAlpha = savedCurrentAlpha;
+
+	checkingGradients = false;
+	currentPixels = nullptr;
+	currentIndices = nullptr;
+	return worst;
+}
+
+unsigned NeuralNetwork::epochsTrained() const {
+	return currentEpoch;
+}
+
+bool NeuralNetwork::stoppedEarly() const {
+	return hasStoppedEarly;
+}
+
+void NeuralNetwork::save(const string & path) const {
+	if (!convolution.empty()) {
+		throw logic_error("checkpoints do not support convolutional layers");
+	}
+
+	ofstream file(path, ios::binary);
+	if (!file) {
+		throw runtime_error("cannot write checkpoint " + path);
+	}
+
+	file.write(checkpointMagic, sizeof(checkpointMagic));
+	file.write((const char *)&checkpointVersion, sizeof(checkpointVersion));
+	uint32_t nLayers = network.size();
+	file.write((const char *)&nLayers, sizeof(nLayers));
+	for (const Layer & layer : network) {
+		uint32_t width = layer.size();
+		file.write((const char *)&width, sizeof(width));
+	}
+	for (vector<Layer>::size_type l = 0; l < network.size(); ++l) {
+		uint8_t activation = l == 0 ? 0 : (uint8_t)activations[l];
+		file.write((const char *)&activation, sizeof(activation));
+	}
+
+	vector<double> row;
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		const BatchNorm & norm = batchNorms[l];
+		for (const Node & node : network[l]) {
+			size_t j = node.layerIndex;
+			double shift = l == 1 && sparseInput ? sparseShifts[j] : 0.0;
+			double scale = 1.0;
+			double bias = node.bias;
+			if (!norm.gamma.empty()) {
+				// as in foldBatchNorm()
+				scale = norm.gamma[j] / sqrt(norm.variance[j] + BATCH_NORM_EPSILON);
+				bias = (node.bias - norm.mean[j]) * scale + norm.beta[j];
+			}
+
+			row.resize(node.weights.size());
+			for (size_t i = 0; i < row.size(); ++i) {
+				row[i] = norm.gamma.empty() ? node.weights[i] + shift : (node.weights[i] + shift) * scale;
+			}
+			file.write((const char *)&bias, sizeof(bias));
+			file.write((const char *)row.data(), row.size() * sizeof(double));
+		}
+	}
+
+	if (!file) {
+		throw runtime_error("cannot write checkpoint " + path);
+	}
+}
+
+void NeuralNetwork::load(const string & path) {
+	if (!convolution.empty()) {
+		throw logic_error("checkpoints do not support convolutional layers");
+	}
+
+	ifstream file(path, ios::binary);
+	char magic[sizeof(checkpointMagic)] = {};
+	uint32_t version = 0;
+	uint32_t nLayers = 0;
+	file.read(magic, sizeof(magic));
+	file.read((char *)&version, sizeof(version));
+	file.read((char *)&nLayers, sizeof(nLayers));
+	if (!file || !equal(magic, magic + sizeof(magic), checkpointMagic) || version != checkpointVersion) {
+		throw runtime_error(path + " is not a checkpoint");
+	}
+
+	vector<uint32_t> widths(nLayers);
+	file.read((char *)widths.data(), nLayers * sizeof(uint32_t));
+	vector<int> topology = getTopology();
+	if (!file || widths.size() != topology.size() || !equal(topology.begin(), topology.end(), widths.begin())) {
+		throw logic_error("checkpoint " + path + " has a different topology");
+	}
+
+	vector<uint8_t> savedActivations(nLayers);
+	file.read((char *)savedActivations.data(), nLayers);
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		if (savedActivations[l] > (uint8_t)Activation::GELU) {
+			throw runtime_error("checkpoint " + path + " has an unknown activation function");
+		}
+		activations[l] = (Activation)savedActivations[l];
+		if (l + 1 < network.size()) {
+			setBatchNorm(l, false);
+		}
+		for (Node & node : network[l]) {
+			file.read((char *)&node.bias, sizeof(double));
+			file.read((char *)node.weights.data(), node.weights.size() * sizeof(double));
+		}
+	}
+	if (!file) {
+		throw runtime_error("checkpoint " + path + " is truncated");
+	}
+
+	if (sparseInput) {
+		fill(sparseShifts.begin(), sparseShifts.end(), 0.0);
+		materializeSparseWeights();
+	}
+}
+
+double NeuralNetwork::trainingLoss() const {
+	return trainLoss;
+}
+
+vector<double> NeuralNetwork::getWeights() const {
+	vector<double> weights;
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		for (const Node & node : network[l]) {
+			// the sparse input path keeps part of the first layer's weights in shifts
+			double shift = l == 1 && sparseInput ? sparseShifts[node.layerIndex] : 0.0;
+			for (double weight : node.weights) {
+				weights.push_back(weight + shift);
+			}
+		}
+	}
+	return weights;
+}
+
+double NeuralNetwork::validationAccuracy() const {
+	return valAccuracy;
+}
+
+double NeuralNetwork::validationLoss() const {
+	return valLoss;
 }
 
 void NeuralNetwork::validate() {
@@ -174,78 +1006,846 @@ void NeuralNetwork::validate() {
     totalCorrectValSamples = 0;
     totalValLoss = 0.0;
 
-	for (vector<vector<double>>::size_type i = 0; i < validationInputs.size(); ++i) {
-		currentInput = &validationInputs[i];
-		currentOutput = &validationOutputs[i];
+	size_t nExamples = validationOutputs.size();
+	validationChunks = (nExamples + VALIDATION_CHUNK - 1) / VALIDATION_CHUNK;
+	validationWorkers = (unsigned)max<size_t>(1, min<size_t>(nThreads, validationChunks));
+	nextValidationChunk = 0;
+	if (deterministic) {
+		validationLosses.resize(nExamples);
+	}
+
+	if (replicas.size() + 1 < validationWorkers) {
+		replicas.resize(validationWorkers - 1);
+	}
+	while (validationThreads.size() + 1 < validationWorkers) {
+		validationThreads.emplace_back(&NeuralNetwork::validationThread, this, (unsigned)validationThreads.size());
+	}
+
+	// the other threads copy the network first, and this thread starts once they are
+	// done as it changes the activations being copied
+	unique_lock<mutex> lock(validationMutex);
+	++validationRound;
+	nCopying = nValidating = validationWorkers - 1;
+	validationWake.notify_all();
+	validationDone.wait(lock, [&]() { return nCopying == 0; });
+	lock.unlock();
+	validateChunks(*this, 0);
+	lock.lock();
+	validationDone.wait(lock, [&]() { return nValidating == 0; });
+	lock.unlock();
+
+	if (deterministic) {
+		for (double loss : validationLosses) {
+			totalValLoss += loss;
+		}
+	}
+	totalValSamples = nExamples;
+	currentPixels = nullptr;
+	currentIndices = nullptr;
+}
+
+void NeuralNetwork::validateChunks(NeuralNetwork & worker, unsigned w) {
+	size_t nExamples = validationOutputs.size();
+	size_t nChunks = validationChunks;
+	unsigned nWorkers = validationWorkers;
+	// a chunk goes through the fully connected layers at once, which needs its inputs
+	// dense and ready, so not through convolution or the sparse input path
+	bool batched = convolution.empty() && validationSparse.size() == 0;
+	// pinned threads read their own copy of their share of the pixels
+	bool sharded = pinThreads && validationSparse.size() == 0 && !validationPixels.empty();
+	size_t inputSize = inputLayer().size();
+
+	if (batched) {
+		worker.gatherLayerWeights();
+	}
+	const double * outputs = worker.batchActivations.back().data();
+	// pinned, each thread takes a fixed range of chunks so its share of the pixels is
+	// known up front; otherwise chunks go to whichever thread is free. Either way only
+	// the sums depend on the threads.
+	size_t lastChunk = (w + 1) * nChunks / nWorkers;
+	auto next = [&](size_t chunk) {
+		if (pinThreads) {
+			return chunk + 1 < lastChunk ? chunk + 1 : nChunks;
+		}
+		return (size_t)nextValidationChunk++;
+	};
+	size_t firstChunk = pinThreads ? w * nChunks / nWorkers : nextValidationChunk++;
+	if (pinThreads && firstChunk == lastChunk) {
+		firstChunk = nChunks;
+	}
+	const uint8_t * pixelBase = nullptr;
+	size_t pixelFirst = 0;
+	if (!validationPixels.empty()) {
+		bool ownShard = sharded && &worker != this;
+		pixelBase = ownShard ? worker.shardPixels.data() : validationPixels.data();
+		pixelFirst = ownShard ? worker.shardFirst : 0;
+	}
+
+	double loss = 0.0;
+	unsigned correct = 0;
+	for (size_t chunk = firstChunk; chunk < nChunks; chunk = next(chunk)) {
+		size_t first = chunk * VALIDATION_CHUNK;
+		size_t end = min(nExamples, first + VALIDATION_CHUNK);
+		if (batched) {
+			for (size_t i = first; i < end; ++i) {
+				double * inputs = &worker.batchActivations[0][(i - first) * inputSize];
+				if (pixelBase) {
+					const uint8_t * pixels = pixelBase + (i - pixelFirst) * inputSize;
+					for (size_t p = 0; p < inputSize; ++p) {
+						inputs[p] = normalizedPixels[pixels[p]];
+					}
+				} else {
+					copy(validationInputs[i].begin(), validationInputs[i].end(), inputs);
+				}
+			}
+			worker.batchForwardPropagate(end - first);
+		}
+
+		for (size_t i = first; i < end; ++i) {
+			if (batched) {
+				for (Node & node : worker.outputLayer()) {
+					node.activation = outputs[(i - first) * nOutputs + node.layerIndex];
+				}
+				worker.currentOutput = &validationOutputs[i];
+			} else {
+				selectValidationExample(worker, i);
+				if (pixelBase) {
+					worker.currentPixels = pixelBase + (i - pixelFirst) * inputSize;
+				}
+				worker.forwardPropagate();
+			}
+
+			if (deterministic) {
+				validationLosses[i] = worker.getLoss();
+			} else {
+				loss += worker.getLoss();
+			}
+			if ((int)*worker.currentOutput == worker.getPredictedLabel()) {
+				++correct;
+			}
+		}
+	}
+	lock_guard<mutex> lock(validationMutex);
+	totalValLoss += loss;
+	totalCorrectValSamples += correct;
+}
 
-		forwardPropagate();
+void NeuralNetwork::validationThread(unsigned r) {
+	// pinned before the replica and shard are made, so they are first touched, and
+	// allocated, on this thread's CPU
+	if (pinThreads) {
+		pinThread(workerCpus[r]);
+	}
+	unsigned round = 0;
+	while (true) {
+		{
+			unique_lock<mutex> lock(validationMutex);
+			validationWake.wait(lock, [&]() { return stopValidation || validationRound != round; });
+			if (stopValidation) {
+				return;
+			}
+			round = validationRound;
+			if (r + 1 >= validationWorkers) {
+				continue;
+			}
+		}
 
-		totalValLoss += getLoss();
-		if ((int)*currentOutput == getPredictedLabel()) {
-			++totalCorrectValSamples;
+		if (!replicas[r]) {
+			replicas[r].reset(new NeuralNetwork(getTopology(), useBias));
+		}
+		NeuralNetwork & worker = *replicas[r];
+		copyParametersTo(worker);
+		// the pixels only change with initialize(), which drops the shards, but the
+		// thread's share changes with the number of threads in the round
+		if (pinThreads && validationSparse.size() == 0 && !validationPixels.empty()) {
+			size_t nExamples = validationOutputs.size();
+			size_t inputSize = inputLayer().size();
+			size_t first = min(nExamples, (r + 1) * validationChunks / validationWorkers * VALIDATION_CHUNK);
+			size_t end = min(nExamples, (r + 2) * validationChunks / validationWorkers * VALIDATION_CHUNK);
+			if (worker.shardFirst != first || worker.shardPixels.size() != (end - first) * inputSize) {
+				worker.shardFirst = first;
+				worker.shardPixels.assign(validationPixels.begin() + first * inputSize,
+					validationPixels.begin() + end * inputSize);
+			}
+		}
+		{
+			lock_guard<mutex> lock(validationMutex);
+			--nCopying;
 		}
-		++totalValSamples;
+		validationDone.notify_all();
+
+		validateChunks(worker, r + 1);
+		{
+			lock_guard<mutex> lock(validationMutex);
+			--nValidating;
+		}
+		validationDone.notify_all();
 	}
 }
 
-double NeuralNetwork::in(vector<Layer>::iterator currLayerIterator, const Node & currLayerNode) {
-	if (currLayerNode.weights.empty()) {
-		return 0.0;
+void NeuralNetwork::stopValidationThreads() {
+	{
+		lock_guard<mutex> lock(validationMutex);
+		stopValidation = true;
 	}
+	validationWake.notify_all();
+	for (thread & t : validationThreads) {
+		t.join();
+	}
+	validationThreads.clear();
+	stopValidation = false;
+}
+
+void NeuralNetwork::selectValidationExample(NeuralNetwork & worker, size_t example) const {
+	if (validationSparse.size() > 0) {
+		worker.currentIndices = &validationSparse.indices[validationSparse.offsets[example]];
+		worker.currentValues = &validationSparse.values[validationSparse.offsets[example]];
+		worker.currentNonzeros = validationSparse.offsets[example+1] - validationSparse.offsets[example];
+	} else if (!validationPixels.empty()) {
+		size_t inputSize = validationPixels.size() / validationOutputs.size();
+		worker.currentPixels = &validationPixels[example * inputSize];
+	} else {
+		worker.currentInput = validationInputs[example].data();
+	}
+	worker.currentOutput = &validationOutputs[example];
+}
 
-	double in = 0.0;
+void NeuralNetwork::gatherLayerWeights() {
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		double * w = layerWeights[l].data();
+		for (const Node & node : network[l]) {
+			w = copy(node.weights.begin(), node.weights.end(), w);
+		}
+	}
+}
+
+void NeuralNetwork::batchForwardPropagate(size_t count) {
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		size_t n = network[l].size();
+		double * x = batchActivations[l].data();
+		for (size_t r = 0; r < count; ++r) {
+			for (const Node & node : network[l]) {
+				x[r * n + node.layerIndex] = node.bias;
+			}
+		}
+		gemm(count, n, network[l-1].size(), batchActivations[l-1].data(), layerWeights[l].data(), x, layerTunings[l]);
+
+		// as batchNormalize() outside training
+		const BatchNorm & norm = batchNorms[l];
+		if (!norm.gamma.empty()) {
+			for (size_t r = 0; r < count; ++r) {
+				for (size_t j = 0; j < n; ++j) {
+					double invStd = 1.0 / sqrt(norm.variance[j] + BATCH_NORM_EPSILON);
+					double normalized = (x[r * n + j] - norm.mean[j]) * invStd;
+					x[r * n + j] = norm.gamma[j] * normalized + norm.beta[j];
+				}
+			}
+		}
+		activate(activations[l], x, x, count * n);
+	}
+}
+
+void NeuralNetwork::copyParametersTo(NeuralNetwork & replica) const {
+	replica.network = network;
+	replica.activations = activations;
+	replica.convolution = convolution;
+	replica.imageInputs.resize(imageInputs.size());
+	replica.batchNorms = batchNorms;
+	replica.layerTunings = layerTunings;
+	replica.sparseInput = sparseInput;
+	replica.sparseShifts = sparseShifts;
+	replica.sparseRowSums = sparseRowSums;
+}
+
+double NeuralNetwork::in(const double * prevActivations, const Node & currLayerNode) {
 	// j.weights[i] is the weight from node i to node j, so j.weights[i] = w_i_j
 	// i = prevLayerNode
 	// j = currLayerNode
-	for (const Node & prevLayerNode : *(currLayerIterator-1)) {
-		in += currLayerNode.weights[prevLayerNode.layerIndex] * prevLayerNode.activation;
+	const double * w = currLayerNode.weights.data();
+	double in = currLayerNode.bias;
+	for (size_t i = 0; i < currLayerNode.weights.size(); ++i) {
+		in += w[i] * prevActivations[i];
 	}
 
 	return in;
 }
 
-void NeuralNetwork::forwardPropagate() {
-	for (Node & n : inputLayer()) {
-		n.activation = currentInput->at(n.layerIndex);
+double NeuralNetwork::updateAndIn(const double * prevActivations, Node & currLayerNode) {
+	// the same update as sgdUpdate, made just before each weight is read
+	double * w = currLayerNode.weights.data();
+	const double * a = pendingInputs.data();
+	double error = currLayerNode.error;
+	double in = currLayerNode.bias;
+	for (size_t i = 0; i < currLayerNode.weights.size(); ++i) {
+		w[i] += pendingAlpha * a[i] * error;
+		in += w[i] * prevActivations[i];
 	}
 
-	for (auto layerIterator = hiddenLayerBegin(); layerIterator != network.end(); ++layerIterator) {
-		for (Node & currLayerNode : *layerIterator) {
-			currLayerNode.activation = g(in(layerIterator, currLayerNode));
+	return in;
+}
+
+void NeuralNetwork::applyPendingUpdate() {
+	if (!firstLayerPending) {
+		return;
+	}
+	const double * a = pendingInputs.data();
+	for (Node & node : network[1]) {
+		double * w = node.weights.data();
+		double error = node.error;
+		for (size_t i = 0; i < node.weights.size(); ++i) {
+			w[i] += pendingAlpha * a[i] * error;
+		}
+	}
+	firstLayerPending = false;
+}
+
+void NeuralNetwork::materializeSparseWeights() {
+	for (Node & node : network[1]) {
+		double shift = sparseShifts[node.layerIndex];
+		double sum = 0.0;
+		for (double & weight : node.weights) {
+			weight += shift;
+			sum += weight;
+		}
+		sparseShifts[node.layerIndex] = 0.0;
+		sparseRowSums[node.layerIndex] = sum;
+	}
+}
+
+// With b = normalizePixel(0), every input is b + d_i where d_i is 0 for background
+// pixels, so w . a = b * sum(w) + sum over nonzero pixels of w_i * d_i. Under SGD every
+// weight of a node also gets alpha * error * b, which goes into the node's shift
+// instead of being added to every weight.
+
+void NeuralNetwork::sparseForwardPropagate() {
+	const double background = normalizedPixels[0];
+	double * d = sparseInputs.data();
+	double sum = 0.0;
+	for (size_t k = 0; k < currentNonzeros; ++k) {
+		d[k] = normalizedPixels[currentValues[k]] - background;
+		sum += d[k];
+	}
+	sparseInputSum = sum;
+
+	double * x = netInputs[1].data();
+	for (const Node & node : network[1]) {
+		const double * w = node.weights.data();
+		double in = node.bias
+			+ background * sparseRowSums[node.layerIndex]
+			+ sparseShifts[node.layerIndex] * sum;
+		for (size_t k = 0; k < currentNonzeros; ++k) {
+			in += w[currentIndices[k]] * d[k];
+		}
+		x[node.layerIndex] = in;
+	}
+}
+
+void NeuralNetwork::sparseUpdateWeights() {
+	const double background = normalizedPixels[0];
+	const double * d = sparseInputs.data();
+	double nInputs = inputLayer().size();
+
+	for (Node & node : network[1]) {
+		double * w = node.weights.data();
+		double step = currentAlpha * node.error;
+		for (size_t k = 0; k < currentNonzeros; ++k) {
+			w[currentIndices[k]] += step * d[k];
+		}
+		sparseShifts[node.layerIndex] += step * background;
+		sparseRowSums[node.layerIndex] += step * (nInputs * background + sparseInputSum);
+		if (useBias) {
+			node.bias += step;
+		}
+	}
+}
+
+// Each block of four nodes takes 16 bits apiece from one counter-based hash of the
+// layer's stream, the example's step, and the block, so masks need no generator state
+// and the loop has no branches.
+static void dropout
+		( const double * a, double * mask, double * dropped, size_t n
+		, double rate, uint64_t key, uint64_t first )
+{
+	uint64_t threshold = (uint64_t)(rate * 65536.0);
+	double scale = 1.0 / (1.0 - rate);
+	for (size_t block = 0; block * 4 < n; ++block) {
+		uint64_t bits = counterHash(key, first + block);
+		size_t end = min(n, block * 4 + 4);
+		for (size_t i = block * 4; i < end; ++i) {
+			mask[i] = (bits & 0xFFFF) >= threshold ? scale : 0.0;
+			dropped[i] = a[i] * mask[i];
+			bits >>= 16;
+		}
+	}
+}
+
+void NeuralNetwork::batchNormalize(vector<Layer>::size_type layer, bool training) {
+	BatchNorm & norm = batchNorms[layer];
+	double * x = netInputs[layer].data();
+	for (size_t j = 0; j < norm.gamma.size(); ++j) {
+		if (training) {
+			norm.mean[j] += BATCH_NORM_MOMENTUM * (x[j] - norm.mean[j]);
+			double deviation = x[j] - norm.mean[j];
+			norm.variance[j] += BATCH_NORM_MOMENTUM * (deviation * deviation - norm.variance[j]);
+		}
+		double invStd = 1.0 / sqrt(norm.variance[j] + BATCH_NORM_EPSILON);
+		norm.normalized[j] = (x[j] - norm.mean[j]) * invStd;
+		norm.scale[j] = norm.gamma[j] * invStd;
+		x[j] = norm.gamma[j] * norm.normalized[j] + norm.beta[j];
+	}
+}
+
+const double * NeuralNetwork::layerInputs(vector<Layer>::size_type layer, bool training) {
+	return training && dropoutRates[layer-1] > 0.0
+		? droppedActivations[layer-1].data()
+		: layerActivations[layer-1].data();
+}
+
+void NeuralNetwork::forwardPropagate(bool training) {
+	// the input layer's activations are the normalized inputs, which the first hidden
+	// layer reads twice (here and in backwardPropagate), so normalize 8-bit pixels once
+	double * inputs = convolution.empty() ? layerActivations[0].data() : imageInputs.data();
+	size_t nInputs = imageSize();
+	if (currentIndices) {
+		sparseForwardPropagate();
+	} else if (currentPixels) {
+		const double * table = normalizedPixels.data();
+		for (size_t i = 0; i < nInputs; ++i) {
+			inputs[i] = table[currentPixels[i]];
+		}
+	} else {
+		copy(currentInput, currentInput + nInputs, inputs);
+	}
+	if (!convolution.empty()) {
+		convolutionForward();
+	}
+
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		double * x = netInputs[l].data();
+		double * a = layerActivations[l].data();
+
+		if (l == 1 && firstLayerPending) {
+			const double * prevActivations = layerInputs(l, training);
+			for (Node & currLayerNode : network[l]) {
+				x[currLayerNode.layerIndex] = updateAndIn(prevActivations, currLayerNode);
+			}
+			firstLayerPending = false;
+		} else if (l > 1 || !currentIndices) {
+			const double * prevActivations = layerInputs(l, training);
+			for (const Node & currLayerNode : network[l]) {
+				x[currLayerNode.layerIndex] = in(prevActivations, currLayerNode);
+			}
+		}
+		if (!batchNorms[l].gamma.empty()) {
+			batchNormalize(l, training && !checkingGradients);
+		}
+		activate(activations[l], x, a, network[l].size());
+		for (Node & currLayerNode : network[l]) {
+			currLayerNode.activation = a[currLayerNode.layerIndex];
+		}
+
+		if (training && dropoutRates[l] > 0.0) {
+			size_t n = network[l].size();
+			dropout(a, dropoutMasks[l].data(), droppedActivations[l].data(), n,
+				dropoutRates[l], childKey(seed ^ DROPOUT_STREAM, l), optimizerStep * ((n + 3) / 4));
 		}
 	}
 }
 
 void NeuralNetwork::backwardPropagate() {
+	if (!schedule.isConstant()) {
+		double epoch = optimizerStep / (double)examplesPerEpoch;
+		currentAlpha = alpha * schedule.scale(epoch, epochs);
+	}
+	++optimizerStep;
+
+	double stepSize = currentAlpha;
+	double epsilon = optimizer.epsilon;
+	if (optimizer.type == Optimizer::Adam) {
+		// fold Adam's bias corrections into the step size and epsilon
+		double correction1 = 1.0 - pow(optimizer.beta1, (double)optimizerStep);
+		double correction2 = sqrt(1.0 - pow(optimizer.beta2, (double)optimizerStep));
+		stepSize = currentAlpha * correction2 / correction1;
+		epsilon *= correction2;
+	}
+
+	vector<Layer>::size_type l = network.size() - 1;
+	const double * dy = layerDerivatives.data();
+
+	derivative(activations[l], netInputs[l].data(), layerActivations[l].data(), layerDerivatives.data(), network[l].size());
 	for (Node & node : outputLayer()) {
-		node.error = gprime(node.activation) * (y(node.layerIndex) - node.activation);
+		node.error = dy[node.layerIndex] * (y(node.layerIndex) - node.activation);
+	}
+
+	// Each layer's weights are read row by row, once: the row's weight times the node's
+	// error is added to the previous layer's error sums, and then the weight is updated.
+	// The sums take the errors in node order, as a column of the weight matrix would.
+	for (; l > 1; --l) {
+		double * sums = layerErrorSums.data();
+		fill(sums, sums + network[l-1].size(), 0.0);
+		updateLayer(l, stepSize, epsilon, sums);
+
+		derivative(activations[l-1], netInputs[l-1].data(), layerActivations[l-1].data(), layerDerivatives.data(), network[l-1].size());
+		for (Node & currLayerNode : network[l-1]) {
+			currLayerNode.error = dy[currLayerNode.layerIndex] * sums[currLayerNode.layerIndex];
+		}
+
+		if (dropoutRates[l-1] > 0.0) {
+			const double * mask = dropoutMasks[l-1].data();
+			for (Node & currLayerNode : network[l-1]) {
+				currLayerNode.error *= mask[currLayerNode.layerIndex];
+			}
+		}
+
+		// the running statistics are treated as constants, so the error of the weighted
+		// input is the output's error times gamma / sqrt(variance)
+		BatchNorm & norm = batchNorms[l-1];
+		if (!norm.gamma.empty()) {
+			for (Node & currLayerNode : network[l-1]) {
+				norm.errors[currLayerNode.layerIndex] = currLayerNode.error;
+				currLayerNode.error *= norm.scale[currLayerNode.layerIndex];
+			}
+		}
 	}
 
-	// output layer at rbegin() => rbegin()+1 = first hidden layer
-	// input layer at rend()-1
-	for (auto layerIterator = network.rbegin()+1; layerIterator != network.rend(); ++layerIterator) {
-		for (Node & currLayerNode : *layerIterator) {
-			double sumPrevError = 0.0;
-			// Node.weights[n] is the weight from node n in the previous layer to this Node
-			// 		if you let n be previous node and m be this, then it's w_n_m = m.weights[n]
-			// i = currLayerNode
-			// j = prevLayerNode
-			// we want w_i_j, so that's prevLayerNode.weights[currLayerNode]
-			for (const Node & prevLayerNode : *(layerIterator-1)) {
-				sumPrevError += prevLayerNode.weights[currLayerNode.layerIndex] * prevLayerNode.error;
+	// the input layer has no activation function, so its error is only needed by
+	// convolutional stages in front of it
+	if (currentIndices) {
+		sparseUpdateWeights();
+	} else if (!convolution.empty()) {
+		double * errors = convolution.back().errors.data();
+		fill(convolution.back().errors.begin(), convolution.back().errors.end(), 0.0);
+		updateLayer(1, stepSize, epsilon, errors);
+		convolutionBackward();
+	} else if (fusingFirstLayer) {
+		// the weights are updated by the next forwardPropagate(), with these inputs,
+		// which it replaces
+		for (Node & node : network[1]) {
+			if (useBias) {
+				node.bias += currentAlpha * node.error;
 			}
+		}
+		pendingInputs.swap(layerActivations[0]);
+		pendingAlpha = currentAlpha;
+		firstLayerPending = true;
+	} else {
+		updateLayer(1, stepSize, epsilon, nullptr);
+	}
 
-			currLayerNode.error = gprime(currLayerNode.activation) * sumPrevError;
+	for (BatchNorm & norm : batchNorms) {
+		for (size_t j = 0; j < norm.gamma.size(); ++j) {
+			norm.gamma[j] += currentAlpha * norm.errors[j] * norm.normalized[j];
+			norm.beta[j] += currentAlpha * norm.errors[j];
 		}
 	}
 }
 
-void NeuralNetwork::updateWeights() {
-	for (auto layerIterator = hiddenLayerBegin(); layerIterator != network.end(); ++layerIterator) {
-		for (Node & currLayerNode : *layerIterator) {
-			for (const Node & prevLayerNode : *(layerIterator-1)) {
-				currLayerNode.weights[prevLayerNode.layerIndex] += alpha * prevLayerNode.activation * currLayerNode.error;
+size_t NeuralNetwork::imageSize() {
+	return convolution.empty() ? inputLayer().size() : imageInputs.size();
+}
+
+// Convolutions unroll their input with im2col so the forward pass, the weight
+// gradient, and the input errors are each a matrix product whose inner loop runs over
+// contiguous output positions.
+
+void NeuralNetwork::convolutionForward() {
+	const double * input = imageInputs.data();
+
+	for (ConvolutionalStage & stage : convolution) {
+		const ConvolutionalLayer & layer = stage.layer;
+		size_t k = layer.kernel;
+		size_t positions = stage.outRows * stage.outCols;
+		double * x = stage.netInputs.data();
+
+		if (layer.type == ConvolutionalLayer::Type::Convolution) {
+			double * columns = stage.columns.data();
+			for (size_t c = 0; c < stage.inChannels; ++c) {
+				for (size_t ky = 0; ky < k; ++ky) {
+					for (size_t kx = 0; kx < k; ++kx) {
+						double * row = columns + ((c * k + ky) * k + kx) * positions;
+						for (size_t oy = 0; oy < stage.outRows; ++oy) {
+							long iy = (long)(oy * layer.stride + ky) - layer.padding;
+							for (size_t ox = 0; ox < stage.outCols; ++ox) {
+								long ix = (long)(ox * layer.stride + kx) - layer.padding;
+								bool inside = iy >= 0 && iy < (long)stage.inRows && ix >= 0 && ix < (long)stage.inCols;
+								row[oy * stage.outCols + ox] = inside
+									? input[(c * stage.inRows + iy) * stage.inCols + ix] : 0.0;
+							}
+						}
+					}
+				}
 			}
+
+			size_t rows = stage.inChannels * k * k;
+			for (size_t o = 0; o < (size_t)layer.channels; ++o) {
+				double * out = x + o * positions;
+				const double * w = &stage.weights[o * rows];
+				fill(out, out + positions, stage.biases[o]);
+				for (size_t r = 0; r < rows; ++r) {
+					const double * column = columns + r * positions;
+					double weight = w[r];
+					for (size_t p = 0; p < positions; ++p) {
+						out[p] += weight * column[p];
+					}
+				}
+			}
+			activate(layer.activation, x, stage.activations.data(), stage.activations.size());
+		} else {
+			bool isMax = layer.type == ConvolutionalLayer::Type::MaxPool;
+			for (size_t c = 0; c < stage.inChannels; ++c) {
+				for (size_t oy = 0; oy < stage.outRows; ++oy) {
+					for (size_t ox = 0; ox < stage.outCols; ++ox) {
+						size_t out = (c * stage.outRows + oy) * stage.outCols + ox;
+						size_t first = (c * stage.inRows + oy * layer.stride) * stage.inCols + ox * layer.stride;
+						double best = input[first];
+						size_t source = first;
+						double sum = 0.0;
+						for (size_t ky = 0; ky < k; ++ky) {
+							for (size_t kx = 0; kx < k; ++kx) {
+								size_t i = first + ky * stage.inCols + kx;
+								if (input[i] > best) {
+									best = input[i];
+									source = i;
+								}
+								sum += input[i];
+							}
+						}
+						if (isMax) {
+							x[out] = best;
+							stage.sources[out] = source;
+						} else {
+							x[out] = sum / (k * k);
+						}
+					}
+				}
+			}
+			copy(stage.netInputs.begin(), stage.netInputs.end(), stage.activations.begin());
+		}
+
+		input = stage.activations.data();
+	}
+
+	copy(convolution.back().activations.begin(), convolution.back().activations.end(), layerActivations[0].begin());
+}
+
+void NeuralNetwork::convolutionBackward() {
+	for (size_t s = convolution.size(); s-- > 0; ) {
+		ConvolutionalStage & stage = convolution[s];
+		const ConvolutionalLayer & layer = stage.layer;
+		size_t k = layer.kernel;
+		size_t positions = stage.outRows * stage.outCols;
+		double * errors = stage.errors.data();
+		// the first stage's input is the image, which needs no errors
+		double * prevErrors = s > 0 ? convolution[s-1].errors.data() : nullptr;
+		size_t nPrev = s > 0 ? convolution[s-1].errors.size() : 0;
+		fill(prevErrors, prevErrors + nPrev, 0.0);
+
+		if (layer.type == ConvolutionalLayer::Type::Convolution) {
+			size_t n = stage.errors.size();
+			double * dy = stage.derivatives.data();
+			derivative(layer.activation, stage.netInputs.data(), stage.activations.data(), dy, n);
+			for (size_t i = 0; i < n; ++i) {
+				errors[i] *= dy[i];
+			}
+
+			size_t rows = stage.inChannels * k * k;
+			double * columns = stage.columns.data();
+
+			if (prevErrors) {
+				// errors of the unrolled input, then folded back onto the input (col2im)
+				double * columnErrors = stage.columnErrors.data();
+				fill(stage.columnErrors.begin(), stage.columnErrors.end(), 0.0);
+				for (size_t o = 0; o < (size_t)layer.channels; ++o) {
+					const double * error = errors + o * positions;
+					const double * w = &stage.weights[o * rows];
+					for (size_t r = 0; r < rows; ++r) {
+						double * columnError = columnErrors + r * positions;
+						double weight = w[r];
+						for (size_t p = 0; p < positions; ++p) {
+							columnError[p] += weight * error[p];
+						}
+					}
+				}
+				for (size_t c = 0; c < stage.inChannels; ++c) {
+					for (size_t ky = 0; ky < k; ++ky) {
+						for (size_t kx = 0; kx < k; ++kx) {
+							const double * row = columnErrors + ((c * k + ky) * k + kx) * positions;
+							for (size_t oy = 0; oy < stage.outRows; ++oy) {
+								long iy = (long)(oy * layer.stride + ky) - layer.padding;
+								for (size_t ox = 0; ox < stage.outCols; ++ox) {
+									long ix = (long)(ox * layer.stride + kx) - layer.padding;
+									if (iy >= 0 && iy < (long)stage.inRows && ix >= 0 && ix < (long)stage.inCols) {
+										prevErrors[(c * stage.inRows + iy) * stage.inCols + ix] += row[oy * stage.outCols + ox];
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+
+			for (size_t o = 0; o < (size_t)layer.channels; ++o) {
+				const double * error = errors + o * positions;
+				double * w = &stage.weights[o * rows];
+				double biasError = 0.0;
+				for (size_t p = 0; p < positions; ++p) {
+					biasError += error[p];
+				}
+				for (size_t r = 0; r < rows; ++r) {
+					const double * column = columns + r * positions;
+					double gradient = 0.0;
+					for (size_t p = 0; p < positions; ++p) {
+						gradient += error[p] * column[p];
+					}
+					w[r] += currentAlpha * gradient;
+				}
+				stage.biases[o] += currentAlpha * biasError;
+			}
+		} else if (prevErrors) {
+			if (layer.type == ConvolutionalLayer::Type::MaxPool) {
+				for (size_t i = 0; i < stage.errors.size(); ++i) {
+					prevErrors[stage.sources[i]] += errors[i];
+				}
+			} else {
+				double share = 1.0 / (k * k);
+				for (size_t c = 0; c < stage.inChannels; ++c) {
+					for (size_t oy = 0; oy < stage.outRows; ++oy) {
+						for (size_t ox = 0; ox < stage.outCols; ++ox) {
+							double error = errors[(c * stage.outRows + oy) * stage.outCols + ox] * share;
+							size_t first = (c * stage.inRows + oy * layer.stride) * stage.inCols + ox * layer.stride;
+							for (size_t ky = 0; ky < k; ++ky) {
+								for (size_t kx = 0; kx < k; ++kx) {
+									prevErrors[first + ky * stage.inCols + kx] += error;
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+// Each kernel updates one node's weights and bias in a single pass, where a[i] * error
+// is the descent direction for weights[i] and error is the descent direction for the
+// bias. State and weights are read and written once.
+
+static inline void momentumStep(double & w, double & v, double d, double alpha, double mu, bool nesterov) {
+	v = mu * v + d;
+	w += alpha * (nesterov ? mu * v + d : v);
+}
+
+static inline void rmsPropStep(double & w, double & s, double d, double alpha, double rho, double epsilon) {
+	s = rho * s + (1.0 - rho) * d * d;
+	w += alpha * d / (sqrt(s) + epsilon);
+}
+
+static inline void adamStep
+		( double & w, double & m, double & s, double d
+		, double stepSize, double beta1, double beta2, double epsilon )
+{
+	m = beta1 * m + (1.0 - beta1) * d;
+	s = beta2 * s + (1.0 - beta2) * d * d;
+	w += stepSize * m / (sqrt(s) + epsilon);
+}
+
+// Each update adds the node's weights times its error to sums, if given, before
+// changing them, so the previous layer's errors come from the same pass over the row.
+
+static void sgdUpdate(Node & node, const double * a, double * sums, double alpha, bool useBias, size_t n) {
+	double * w = node.weights.data();
+	double error = node.error;
+	if (sums) {
+		for (size_t i = 0; i < n; ++i) {
+			sums[i] += w[i] * error;
+			w[i] += alpha * a[i] * error;
+		}
+	} else {
+		for (size_t i = 0; i < n; ++i) {
+			w[i] += alpha * a[i] * error;
+		}
+	}
+	if (useBias) {
+		node.bias += alpha * error;
+	}
+}
+
+static void momentumUpdate
+		( Node & node, const double * a, double * sums
+		, double alpha, double mu, bool nesterov, bool useBias, size_t n )
+{
+	double * w = node.weights.data();
+	double * v = node.firstMoment.data();
+	double error = node.error;
+	for (size_t i = 0; i < n; ++i) {
+		if (sums) {
+			sums[i] += w[i] * error;
+		}
+		momentumStep(w[i], v[i], a[i] * error, alpha, mu, nesterov);
+	}
+	if (useBias) {
+		momentumStep(node.bias, node.biasFirstMoment, error, alpha, mu, nesterov);
+	}
+}
+
+static void rmsPropUpdate
+		( Node & node, const double * a, double * sums
+		, double alpha, double rho, double epsilon, bool useBias, size_t n )
+{
+	double * w = node.weights.data();
+	double * s = node.secondMoment.data();
+	double error = node.error;
+	for (size_t i = 0; i < n; ++i) {
+		if (sums) {
+			sums[i] += w[i] * error;
+		}
+		rmsPropStep(w[i], s[i], a[i] * error, alpha, rho, epsilon);
+	}
+	if (useBias) {
+		rmsPropStep(node.bias, node.biasSecondMoment, error, alpha, rho, epsilon);
+	}
+}
+
+static void adamUpdate
+		( Node & node, const double * a, double * sums
+		, double stepSize, double beta1, double beta2, double epsilon, bool useBias, size_t n )
+{
+	double * w = node.weights.data();
+	double * m = node.firstMoment.data();
+	double * s = node.secondMoment.data();
+	double error = node.error;
+	for (size_t i = 0; i < n; ++i) {
+		if (sums) {
+			sums[i] += w[i] * error;
+		}
+		adamStep(w[i], m[i], s[i], a[i] * error, stepSize, beta1, beta2, epsilon);
+	}
+	if (useBias) {
+		adamStep(node.bias, node.biasFirstMoment, node.biasSecondMoment, error,
+			stepSize, beta1, beta2, epsilon);
+	}
+}
+
+void NeuralNetwork::updateLayer(vector<Layer>::size_type l, double stepSize, double epsilon, double * sums) {
+	const double * a = layerInputs(l, true);
+	size_t n = network[l-1].size();
+
+	for (Node & currLayerNode : network[l]) {
+		switch (optimizer.type) {
+		case Optimizer::SGD:
+			sgdUpdate(currLayerNode, a, sums, currentAlpha, useBias, n);
+			break;
+		case Optimizer::Momentum:
+		case Optimizer::Nesterov:
+			momentumUpdate(currLayerNode, a, sums, currentAlpha,
+				optimizer.beta1, optimizer.type == Optimizer::Nesterov, useBias, n);
+			break;
+		case Optimizer::RMSProp:
+			rmsPropUpdate(currLayerNode, a, sums, currentAlpha, optimizer.beta2, epsilon, useBias, n);
+			break;
+		case Optimizer::Adam:
+			adamUpdate(currLayerNode, a, sums, stepSize, optimizer.beta1, optimizer.beta2, epsilon, useBias, n);
+			break;
 		}
 	}
 }
@@ -259,29 +1859,137 @@ double NeuralNetwork::randWeight() {
 	return r;
 }
 
-// assign random weights to nodes
+// assign random weights to nodes and zero the biases
 void NeuralNetwork::initWeights() {
 	// Node.weights[i] is the weight from node i in the previous layer to this Node
 	// therefore, network[0] (input layer) has weights.empty()
 
-	for (Layer & layer : network) {
-		for (Node & node : layer) {
-			for (double & weight : node.weights) {
-				weight = randWeight();
+	for (vector<Layer>::size_type l = 1; l < network.size(); ++l) {
+		double fanIn = network[l-1].size();
+		double fanOut = network[l].size();
+
+		WeightInit init = weightInits[l];
+		if (init == WeightInit::Auto) {
+			bool saturating = activations[l] == Activation::Sigmoid || activations[l] == Activation::Tanh;
+			init = saturating ? WeightInit::XavierUniform : WeightInit::HeNormal;
+		}
+
+		uint64_t key = childKey(seed, l);
+		for (Node & node : network[l]) {
+			double * w = node.weights.data();
+			size_t n = node.weights.size();
+			uint64_t first = node.layerIndex * n;
+
+			switch (init) {
+			case WeightInit::Auto:
+			case WeightInit::Uniform:
+				for (double & weight : node.weights) {
+					weight = randWeight();
+				}
+				break;
+			case WeightInit::XavierUniform:
+				fillUniform(w, n, key, first, -sqrt(6.0 / (fanIn + fanOut)), sqrt(6.0 / (fanIn + fanOut)));
+				break;
+			case WeightInit::XavierNormal:
+				fillNormal(w, n, key, first, 0.0, sqrt(2.0 / (fanIn + fanOut)));
+				break;
+			case WeightInit::HeUniform:
+				fillUniform(w, n, key, first, -sqrt(6.0 / fanIn), sqrt(6.0 / fanIn));
+				break;
+			case WeightInit::HeNormal:
+				fillNormal(w, n, key, first, 0.0, sqrt(2.0 / fanIn));
+				break;
 			}
+			node.bias = 0.0;
 		}
 	}
+
+	// convolutions pick Xavier or He like Auto, from streams keyed by the unused
+	// input layer
+	uint64_t convolutionKey = childKey(seed, 0);
+	for (size_t s = 0; s < convolution.size(); ++s) {
+		ConvolutionalStage & stage = convolution[s];
+		const ConvolutionalLayer & layer = stage.layer;
+		if (layer.type != ConvolutionalLayer::Type::Convolution) {
+			continue;
+		}
+
+		double fanIn = stage.inChannels * layer.kernel * layer.kernel;
+		double fanOut = layer.channels * layer.kernel * layer.kernel;
+		uint64_t key = childKey(convolutionKey, s);
+		if (layer.activation == Activation::Sigmoid || layer.activation == Activation::Tanh) {
+			fillUniform(stage.weights.data(), stage.weights.size(), key, 0, -sqrt(6.0 / (fanIn + fanOut)), sqrt(6.0 / (fanIn + fanOut)));
+		} else {
+			fillNormal(stage.weights.data(), stage.weights.size(), key, 0, 0.0, sqrt(2.0 / fanIn));
+		}
+		fill(stage.biases.begin(), stage.biases.end(), 0.0);
+	}
 }
 
-#if USE_TANH
-double NeuralNetwork::g(double x) 
-	{ return (exp(x) - exp(-x))/(exp(x) + exp(-x)); }
-double NeuralNetwork::gprime(double y) { return 1 - (y*y); }
+// The kernels switch on the activation once per layer so the loops are branch-free
+// apart from selects, which the compiler turns into blends.
 
-#else
-double NeuralNetwork::g(double x) { return 1.0 / (1.0 + exp(-x)); }
-double NeuralNetwork::gprime(double y) { return y * (1 - y); }
-#endif
+void NeuralNetwork::activate(Activation activation, const double * x, double * y, size_t n) {
+	switch (activation) {
+	case Activation::Sigmoid:
+		for (size_t i = 0; i < n; ++i) {
+			y[i] = 1.0 / (1.0 + exp(-x[i]));
+		}
+		break;
+	case Activation::Tanh:
+		for (size_t i = 0; i < n; ++i) {
+			y[i] = (exp(x[i]) - exp(-x[i]))/(exp(x[i]) + exp(-x[i]));
+		}
+		break;
+	case Activation::ReLU:
+		for (size_t i = 0; i < n; ++i) {
+			y[i] = x[i] > 0.0 ? x[i] : 0.0;
+		}
+		break;
+	case Activation::LeakyReLU:
+		for (size_t i = 0; i < n; ++i) {
+			y[i] = x[i] > 0.0 ? x[i] : LEAKY_RELU_SLOPE * x[i];
+		}
+		break;
+	case Activation::GELU:
+		for (size_t i = 0; i < n; ++i) {
+			y[i] = 0.5 * x[i] * (1.0 + tanh(GELU_SCALE * (x[i] + GELU_CUBIC * x[i] * x[i] * x[i])));
+		}
+		break;
+	}
+}
+
+void NeuralNetwork::derivative(Activation activation, const double * x, const double * y, double * dy, size_t n) {
+	switch (activation) {
+	case Activation::Sigmoid:
+		for (size_t i = 0; i < n; ++i) {
+			dy[i] = y[i] * (1 - y[i]);
+		}
+		break;
+	case Activation::Tanh:
+		for (size_t i = 0; i < n; ++i) {
+			dy[i] = 1 - (y[i]*y[i]);
+		}
+		break;
+	case Activation::ReLU:
+		for (size_t i = 0; i < n; ++i) {
+			dy[i] = x[i] > 0.0 ? 1.0 : 0.0;
+		}
+		break;
+	case Activation::LeakyReLU:
+		for (size_t i = 0; i < n; ++i) {
+			dy[i] = x[i] > 0.0 ? 1.0 : LEAKY_RELU_SLOPE;
+		}
+		break;
+	case Activation::GELU:
+		for (size_t i = 0; i < n; ++i) {
+			double t = tanh(GELU_SCALE * (x[i] + GELU_CUBIC * x[i] * x[i] * x[i]));
+			dy[i] = 0.5 * (1.0 + t)
+				+ 0.5 * x[i] * (1.0 - t * t) * GELU_SCALE * (1.0 + 3.0 * GELU_CUBIC * x[i] * x[i]);
+		}
+		break;
+	}
+}
 
 void NeuralNetwork::printOutput(int precision) {
 	cout << "{ ";
@@ -331,11 +2039,9 @@ int NeuralNetwork::getPredictedLabel() {
 		}
 		++result;
 	}
-	if (result > 9) {
-		throw logic_error("invalid output result");
-	}
-
-	return result;
+	// an output above the last range, possible with an activation function that is
+	// not bounded by 1, counts as the last label, as in StaticNetwork::predict
+	return min(result, 9);
 }
 
 #else
@@ -365,7 +2071,7 @@ double NeuralNetwork::getLoss() {
 
 	for (const Node & node : outputLayer()) { 
 		yioi = y(node.layerIndex) - node.activation;
-		loss += 100.0 * yioi * yioi;
+		loss += LOSS_SCALE * yioi * yioi;
 	}
 
 	return loss;
@@ -1,6 +1,16 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <random>
+#include <string>
+#include <thread>
+#include "Backend.h"
+#include "BatchLoader.h"
+#include "LearningRateSchedule.h"
 
 using namespace std;
 
@@ -16,11 +26,271 @@ public:
 	 * @param[in]  nHiddenLayers    The number of hidden layers
 	 * @param[in]  hiddenLayerSize  The number of nodes in each hidden layer
 	 * @param[in]  nOutputs         The number of outputs
+	 * @param[in]  useBias          Should every hidden and output node learn a bias?
 	 */
-	NeuralNetwork(int nInputs, int nHiddenLayers, int hiddenLayerSize, int nOutputs);
+	NeuralNetwork(int nInputs, int nHiddenLayers, int hiddenLayerSize, int nOutputs, bool useBias = false);
+
+	/**
+	 * @brief      Constructs a new neural network with a width for every layer. Must
+	 *             call #initialize before running.
+	 *
+	 * @param[in]  topology  The number of nodes in each layer, from the input layer to
+	 *                       the output layer
+	 * @param[in]  useBias   Should every hidden and output node learn a bias?
+	 */
+	NeuralNetwork(const vector<int> & topology, bool useBias = false);
+
+	/**
+	 * @brief      The topology of a network whose hidden layers all have the same width.
+	 *
+	 * @param[in]  nInputs          The number of inputs
+	 * @param[in]  nHiddenLayers    The number of hidden layers
+	 * @param[in]  hiddenLayerSize  The number of nodes in each hidden layer
+	 * @param[in]  nOutputs         The number of outputs
+	 *
+	 * @return     The width of each layer.
+	 */
+	static vector<int> uniformTopology(int nInputs, int nHiddenLayers, int hiddenLayerSize, int nOutputs);
+
+	/**
+	 * @brief      Parse a topology written as layer widths joined by dashes, e.g.
+	 *             "784-256-64-10".
+	 *
+	 * @param[in]  description  The topology
+	 *
+	 * @return     The width of each layer.
+	 */
+	static vector<int> parseTopology(const string & description);
+
+	/**
+	 * @return     The width of each layer, from the input layer to the output layer.
+	 */
+	vector<int> getTopology() const;
 
 	~NeuralNetwork();
 
+	/**
+	 * @brief      Criteria for ending trainAndValidate() before #epochs have run.
+	 */
+	struct EarlyStopping {
+		/** Epochs without a validation loss improvement before stopping. 0 disables. */
+		unsigned patience;
+		/** The minimum decrease in validation loss that counts as an improvement. */
+		double minDelta;
+		/** Stop once the validation accuracy reaches this value. Values above 1 disable. */
+		double targetAccuracy;
+
+		EarlyStopping(unsigned patience = 0, double minDelta = 0.0, double targetAccuracy = 2.0);
+	};
+
+	/**
+	 * @brief      Set the criteria checked after every validated epoch. By default
+	 *             training always runs to completion.
+	 *
+	 * @param[in]  criteria  The early stopping criteria
+	 */
+	void setEarlyStopping(const EarlyStopping & criteria);
+
+	/**
+	 * @brief      The rule used by backwardPropagate() to turn errors into weight changes.
+	 */
+	enum class Optimizer { SGD, Momentum, Nesterov, RMSProp, Adam };
+
+	/**
+	 * @brief      An optimizer and its hyperparameters.
+	 */
+	struct OptimizerSettings {
+		Optimizer type;
+		/** Decay of the first moment (momentum for Momentum and Nesterov). */
+		double beta1;
+		/** Decay of the second moment (RMSProp and Adam). */
+		double beta2;
+		/** Added to the root of the second moment to avoid dividing by zero. */
+		double epsilon;
+
+		OptimizerSettings(Optimizer type = Optimizer::SGD, double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8);
+	};
+
+	/**
+	 * @brief      Set the optimizer, clearing any optimizer state. Defaults to plain SGD.
+	 *
+	 * @param[in]  settings  The optimizer and its hyperparameters
+	 */
+	void setOptimizer(const OptimizerSettings & settings);
+
+	/**
+	 * @brief      The activation function applied by a layer.
+	 */
+	enum class Activation { Sigmoid, Tanh, ReLU, LeakyReLU, GELU };
+
+	/**
+	 * @brief      Apply an activation function to a whole layer.
+	 *
+	 * @param[in]  activation  The activation function
+	 * @param[in]  x           The weighted inputs
+	 * @param[out] y           The activations, which may be \p x
+	 * @param[in]  n           The number of nodes in the layer
+	 */
+	static void activate(Activation activation, const double * x, double * y, size_t n);
+
+	/**
+	 * @brief      Set the activation function of one layer. Every layer defaults to
+	 *             Sigmoid. Call before #initialize, since the weight initialization
+	 *             depends on it.
+	 *
+	 * @param[in]  layer       The layer, where 1 is the first hidden layer
+	 * @param[in]  activation  The activation function
+	 */
+	void setActivation(vector<int>::size_type layer, Activation activation);
+
+	/**
+	 * @brief      Set the activation function of every hidden layer and of the output layer.
+	 *
+	 * @param[in]  hidden  The activation function for the hidden layers
+	 * @param[in]  output  The activation function for the output layer
+	 */
+	void setActivations(Activation hidden, Activation output);
+
+	/**
+	 * @brief      How a layer's weights are initialized.
+	 *
+	 *             - Auto:          XavierUniform for Sigmoid and Tanh layers, HeNormal for
+	 *                              ReLU, LeakyReLU, and GELU layers
+	 *             - Uniform:       uniform on [-0.5, 0.5] regardless of fan-in, drawn with
+	 *                              randWeight() as in earlier versions
+	 *             - XavierUniform: uniform on +-sqrt(6 / (fan-in + fan-out))
+	 *             - XavierNormal:  normal with variance 2 / (fan-in + fan-out)
+	 *             - HeUniform:     uniform on +-sqrt(6 / fan-in)
+	 *             - HeNormal:      normal with variance 2 / fan-in
+	 */
+	enum class WeightInit { Auto, Uniform, XavierUniform, XavierNormal, HeUniform, HeNormal };
+
+	/**
+	 * @brief      Set how one layer's weights are initialized. Every layer defaults to
+	 *             Auto. Call before #initialize.
+	 *
+	 * @param[in]  layer  The layer, where 1 is the first hidden layer
+	 * @param[in]  init   The initialization scheme
+	 */
+	void setWeightInit(vector<int>::size_type layer, WeightInit init);
+
+	/**
+	 * @brief      Set how every layer's weights are initialized.
+	 *
+	 * @param[in]  init  The initialization scheme
+	 */
+	void setWeightInit(WeightInit init);
+
+	/**
+	 * @brief      Set the fraction of a hidden layer's activations dropped on each
+	 *             training example. The rest are scaled by 1 / (1 - rate), so nothing
+	 *             is dropped or scaled when validating. Defaults to 0.
+	 *
+	 * @param[in]  layer  The hidden layer, where 1 is the first hidden layer
+	 * @param[in]  rate   The fraction dropped, in [0, 1)
+	 */
+	void setDropout(vector<int>::size_type layer, double rate);
+
+	/**
+	 * @brief      Set the dropout rate of every hidden layer.
+	 *
+	 * @param[in]  rate  The fraction dropped, in [0, 1)
+	 */
+	void setDropout(double rate);
+
+	/**
+	 * @brief      Normalize a hidden layer's weighted inputs by their running mean and
+	 *             variance, then scale and shift them by learned per-node parameters,
+	 *             before the activation function. The scale and shift are always
+	 *             updated with SGD. Call before #initialize.
+	 *
+	 * @param[in]  layer    The hidden layer, where 1 is the first hidden layer
+	 * @param[in]  enabled  Should the layer be normalized?
+	 */
+	void setBatchNorm(vector<int>::size_type layer, bool enabled);
+
+	/**
+	 * @brief      Normalize every hidden layer or none.
+	 *
+	 * @param[in]  enabled  Should the hidden layers be normalized?
+	 */
+	void setBatchNorm(bool enabled);
+
+	/**
+	 * @brief      Fold every batch normalization into the weights and biases of its
+	 *             layer and remove it, so the network computes the same outputs without
+	 *             the extra pass. Call when training is done, e.g. before testing or
+	 *             exporting the weights.
+	 */
+	void foldBatchNorm();
+
+	/**
+	 * @brief      A convolution or pooling layer in front of the fully connected layers.
+	 */
+	struct ConvolutionalLayer {
+		enum class Type { Convolution, MaxPool, AvgPool };
+
+		Type type;
+		/** The number of output channels. Pooling keeps the number of channels. */
+		int channels;
+		/** The width and height of the kernel or pooling window. */
+		int kernel;
+		int stride;
+		/** Zeros added around each side of the input. Convolutions only. */
+		int padding;
+		/** Applied to the output of convolutions. */
+		Activation activation;
+
+		ConvolutionalLayer(Type type, int channels, int kernel, int stride = 1, int padding = 0, Activation activation = Activation::ReLU);
+	};
+
+	/**
+	 * @brief      Parse convolution and pooling layers joined by dashes, where
+	 *             "conv8k5s1p2" is a convolution with 8 channels, a 5x5 kernel, stride 1
+	 *             and padding 2 (stride and padding are optional), and "max2s2" and
+	 *             "avg2" are 2x2 pooling windows with a stride that defaults to their
+	 *             size, e.g. "conv8k5p2-max2-conv16k5p2-max2".
+	 *
+	 * @param[in]  description  The layers
+	 * @param[in]  activation   The activation function of every convolution
+	 *
+	 * @return     The layers.
+	 */
+	static vector<ConvolutionalLayer> parseConvolution(const string & description, Activation activation = Activation::ReLU);
+
+	/**
+	 * @brief      The number of values produced from a single channel image by
+	 *             convolution and pooling layers, which must be the width of the input
+	 *             layer of the fully connected layers behind them.
+	 *
+	 * @param[in]  rows    The height of the image
+	 * @param[in]  cols    The width of the image
+	 * @param[in]  layers  The convolution and pooling layers
+	 *
+	 * @return     The number of outputs.
+	 */
+	static int convolutionOutputSize(int rows, int cols, const vector<ConvolutionalLayer> & layers);
+
+	/**
+	 * @brief      Put convolution and pooling layers between the images and the input
+	 *             layer, whose width must be #convolutionOutputSize. Their weights are
+	 *             initialized with the rest and are always updated with SGD. Not
+	 *             supported with the sparse input path. Call before #initialize.
+	 *
+	 * @param[in]  rows    The height of the images
+	 * @param[in]  cols    The width of the images
+	 * @param[in]  layers  The convolution and pooling layers
+	 */
+	void setConvolution(int rows, int cols, const vector<ConvolutionalLayer> & layers);
+
+	/**
+	 * @brief      Set the learning rate schedule applied on top of the \p alpha passed
+	 *             to #initialize. Defaults to a constant rate.
+	 *
+	 * @param[in]  schedule  The schedule
+	 */
+	void setLearningRateSchedule(const LearningRateSchedule & schedule);
+
 	/**
 	 * @brief      Initialize the neural network with the given values. 
 	 *             May be called with the testing sets as the validation arguments and 
@@ -46,6 +316,92 @@ public:
 			, unsigned epochs
 			, bool shouldInitWeights = true );
 
+	/**
+	 * @brief      Initialize the neural network with 8-bit images, which are kept 8-bit
+	 *             and normalized as they enter the input layer. Training images are
+	 *             gathered into batches on background threads while training (see
+	 *             #setBatchPipeline). Otherwise the same as the overload taking
+	 *             normalized inputs.
+	 *
+	 * @param[in]  alpha              The learning rate
+	 * @param[in]  seed               The seed for initializing the weights and shuffling
+	 * @param[in]  exampleImages      The training images
+	 * @param[in]  exampleOutputs     The training outputs
+	 * @param[in]  validationImages   The validation images
+	 * @param[in]  validationOutputs  The validation outputs
+	 * @param[in]  epochs             The number of training epochs
+	 * @param[in]  shouldInitWeights  Should we initialize weights to random values?
+	 */
+	void initialize
+			( double alpha
+			, unsigned seed
+			, const vector<vector<uint8_t>> & exampleImages
+			, const vector<double> & exampleOutputs
+			, const vector<vector<uint8_t>> & validationImages
+			, const vector<double> & validationOutputs 
+			, unsigned epochs
+			, bool shouldInitWeights = true );
+
+	/**
+	 * @brief      Configure the batch pipeline used when training from 8-bit images.
+	 *             Call before #initialize.
+	 *
+	 * @param[in]  batchSize  The number of examples assembled together
+	 * @param[in]  ringSize   The number of batch buffers; 2 double-buffers
+	 * @param[in]  nWorkers   The number of threads assembling batches
+	 * @param[in]  shuffle    Should every epoch visit the examples in a new random order?
+	 */
+	void setBatchPipeline(size_t batchSize, unsigned ringSize, unsigned nWorkers, bool shuffle);
+
+	/**
+	 * @brief      Set the distortions applied to 8-bit training images by the batch
+	 *             pipeline. Off by default. Call before #initialize.
+	 *
+	 * @param[in]  augmentation  The distortions
+	 */
+	void setAugmentation(const Augmentation & augmentation);
+
+	/**
+	 * @brief      Set how many threads validate the network. In deterministic mode every
+	 *             example's loss is kept and the losses are added up in example order
+	 *             afterwards, so the results are the same for any number of threads and
+	 *             bitwise the same as with one. Otherwise each thread adds up its own
+	 *             losses and the sums are combined as the threads finish, which saves the
+	 *             pass over the losses but can change the last bits from run to run.
+	 *             Defaults to 1 thread, deterministic.
+	 *
+	 *             Pinned, the other threads are spread over the NUMA nodes and each stays
+	 *             on one CPU, takes a fixed share of the examples, and builds its copy of
+	 *             the network and of its share of the pixels itself, so they are allocated
+	 *             on its own node. The results are the same either way.
+	 *
+	 * @param[in]  nThreads       The number of threads, including the calling thread
+	 * @param[in]  deterministic  Should the results be independent of the threads?
+	 * @param[in]  pinned         Should the other threads be pinned to CPUs?
+	 */
+	void setThreads(unsigned nThreads, bool deterministic = true, bool pinned = false);
+
+	/**
+	 * @brief      Choose how gemm() runs each fully connected layer in validation on this
+	 *             machine, with autotuneGemm(). The choice never changes the results.
+	 *
+	 * @param[in]  cachePath  The file the choices are kept in between runs
+	 * @param[in]  retune     Should they be measured again even if they are cached?
+	 *
+	 * @return     The tuning of each layer after the input layer.
+	 */
+	vector<GemmTuning> autotune(const string & cachePath, bool retune = false);
+
+	/**
+	 * @brief      Keep 8-bit images as their nonzero pixels, so the first hidden layer
+	 *             only visits those when propagating forward and updating its weights.
+	 *             Only supported with the SGD optimizer. Off by default. Call before
+	 *             #initialize.
+	 *
+	 * @param[in]  sparse  Should the sparse input path be used?
+	 */
+	void setSparseInput(bool sparse);
+
 	/**
 	 * @brief      Train the function over the training inputs and validate on each 
 	 * 			   epoch. 
@@ -55,6 +411,16 @@ public:
 	 * @param[in]  precision  The precision for printing the floating point values.
 	 */
 	void trainAndValidate(int precision = 3);
+	/**
+	 * @brief      Train and validate for up to \p nEpochs more epochs without printing,
+	 *             continuing from the current epoch. Used by schedulers that hand out
+	 *             epochs incrementally. Stops early if the #EarlyStopping criteria are met.
+	 *
+	 * @param[in]  nEpochs  The maximum number of epochs to run
+	 *
+	 * @return     The number of epochs actually run.
+	 */
+	unsigned continueTraining(unsigned nEpochs);
 	/**
 	 * @brief      Train the network over the given training inputs.
 	 */
@@ -64,6 +430,23 @@ public:
 	 */
 	void validate();
 
+	/**
+	 * @brief      Compare the gradient of the loss on one example found by the training
+	 *             kernels with central differences, for every weight, bias, and batch
+	 *             normalization parameter of every layer. Dropout masks are drawn as in
+	 *             training and batch normalization statistics are held fixed. Trains
+	 *             nothing: every parameter and all optimizer state is restored.
+	 *
+	 * @param[in]  image    The example's 8-bit image
+	 * @param[in]  output   The example's expected output
+	 * @param[in]  epsilon  The step of the central differences
+	 *
+	 * @return     The largest relative error, |numeric - analytic| / (|numeric| +
+	 *             |analytic|), over parameters whose numeric and analytic gradients
+	 *             add up to more than 1e-4.
+	 */
+	double checkGradients(const vector<uint8_t> & image, double output, double epsilon = 1e-4);
+
 	/**
 	 * @brief      Shows the training result.
 	 *
@@ -77,18 +460,79 @@ public:
 	 */
 	void showValidationResult(int precision = 3);
 
+	/**
+	 * @return     The number of epochs trained so far.
+	 */
+	unsigned epochsTrained() const;
+	/**
+	 * @return     Whether the #EarlyStopping criteria have been met.
+	 */
+	bool stoppedEarly() const;
+	/**
+	 * @brief      Write the topology, activation functions, weights, and biases to a
+	 *             checkpoint, with any batch normalization folded in. Checkpoints are
+	 *             binary in the machine's byte order:
+	 *
+	 *             - #checkpointMagic ("NNCK") and #checkpointVersion, a uint32_t
+	 *             - the number of layers, a uint32_t, then the width of each
+	 *             - the activation function of each layer, a uint8_t (0 for the input)
+	 *             - for each node of each layer after the input, its bias and then its
+	 *               weights, as doubles
+	 *
+	 *             Networks with convolutional layers cannot be saved yet.
+	 *
+	 * @param[in]  path  The file to write
+	 */
+	void save(const string & path) const;
+
+	/**
+	 * @brief      Read the activation functions, weights, and biases written by #save
+	 *             by a network with the same topology, removing any batch normalization.
+	 *
+	 * @param[in]  path  The file to read
+	 */
+	void load(const string & path);
+
+	/** The bytes every checkpoint starts with, and the format version after them. */
+	static constexpr char checkpointMagic[4] = { 'N', 'N', 'C', 'K' };
+	static constexpr uint32_t checkpointVersion = 1;
+
+	/**
+	 * @return     The training loss of the last validated epoch.
+	 */
+	double trainingLoss() const;
+	/**
+	 * @return     The validation accuracy of the last validated epoch.
+	 */
+	double validationAccuracy() const;
+	/**
+	 * @return     The validation loss of the last validated epoch.
+	 */
+	double validationLoss() const;
+
+	/**
+	 * @return     Every weight of the fully connected layers, layer by layer, one row of
+	 *             the previous layer's width per node.
+	 */
+	vector<double> getWeights() const;
+
 	/**
 	 * @brief      A Single node in the neural network.
 	 */
 	struct Node {
-		static unsigned number_count; 
-		unsigned number;
-
 		vector<Node>::size_type layerIndex;
 
 		double activation;
 		double error;
 		vector<double> weights;
+		/** Added to the weighted input. Stays 0 unless the network uses biases. */
+		double bias;
+
+		// optimizer state, parallel to weights and empty when unused
+		vector<double> firstMoment;
+		vector<double> secondMoment;
+		double biasFirstMoment;
+		double biasSecondMoment;
 
 		/**
 		 * @brief      Create a new Node.
@@ -104,21 +548,168 @@ public:
 
 private:
 	double alpha;
+	double currentAlpha;
+	LearningRateSchedule schedule;
 	unsigned epochs;
 	unsigned currentEpoch;
 	vector<Layer>::size_type nOutputs;
+	bool useBias;
 
 	vector<Layer> network;
 
-	const vector<double> * currentInput;
+	vector<Activation> activations;
+	vector<WeightInit> weightInits;
+	unsigned seed;
+
+	OptimizerSettings optimizer;
+	unsigned long optimizerStep;
+
+	// contiguous copies of each layer's weighted inputs and activations, filled by
+	// forwardPropagate() and read by the activation, derivative, and update kernels
+	vector<vector<double>> netInputs;
+	vector<vector<double>> layerActivations;
+	vector<double> layerDerivatives;
+	// the previous layer's weighted error sums, accumulated by backwardPropagate()
+	vector<double> layerErrorSums;
+
+	/**
+	 * @brief      The batch normalization of one layer, empty if the layer has none.
+	 */
+	struct BatchNorm {
+		vector<double> gamma;
+		vector<double> beta;
+		vector<double> mean;
+		vector<double> variance;
+		// the current example's normalized weighted inputs, gamma / sqrt(variance), and
+		// the errors of the outputs
+		vector<double> normalized;
+		vector<double> scale;
+		vector<double> errors;
+	};
+	vector<BatchNorm> batchNorms;
+
+	unsigned nThreads;
+	bool deterministic;
+	// copies of the network validating on the other threads, each made by its own
+	// thread; the calling thread uses this network
+	vector<unique_ptr<NeuralNetwork>> replicas;
+	// the CPU each other thread is pinned to, if pinThreads
+	bool pinThreads;
+	vector<int> workerCpus;
+	// a pinned replica's share of validationPixels, from example shardFirst on
+	vector<uint8_t> shardPixels;
+	size_t shardFirst;
+	// the other threads, started by the first validate() that needs them and kept
+	// until the thread settings change; each validate() is a new round for them
+	vector<thread> validationThreads;
+	mutex validationMutex;
+	condition_variable validationWake;
+	condition_variable validationDone;
+	unsigned validationRound;
+	bool stopValidation;
+	// threads of the current round still copying the network, or still validating
+	unsigned nCopying;
+	unsigned nValidating;
+	// how the current round splits the validation set
+	size_t validationChunks;
+	unsigned validationWorkers;
+	atomic<size_t> nextValidationChunk;
+	// each validation example's loss, kept in deterministic mode
+	vector<double> validationLosses;
+	// validation of whole chunks: each layer's weights as one matrix with a row per
+	// node, and each layer's activations with a row per example of the chunk
+	vector<vector<double>> layerWeights;
+	vector<vector<double>> batchActivations;
+	// how gemm() multiplies by each layer's weights
+	vector<GemmTuning> layerTunings;
+
+	// set by checkGradients() to keep batch normalization statistics fixed
+	bool checkingGradients;
+
+	// dropout: each layer's rate, and for layers with a nonzero rate the mask (0 or
+	// 1 / (1 - rate)) and the masked activations read by the next layer in training
+	vector<double> dropoutRates;
+	vector<vector<double>> dropoutMasks;
+	vector<vector<double>> droppedActivations;
+
+	// exactly one of currentInput and currentPixels is set
+	const double * currentInput;
+	const uint8_t * currentPixels;
 	const double * currentOutput;
 
 	vector<vector<double>> exampleInputs;
+	size_t examplesPerEpoch;
+
+	// batch pipeline, used instead of exampleInputs when training from 8-bit images
+	unique_ptr<BatchLoader> loader;
+	size_t batchSize;
+	unsigned ringSize;
+	unsigned nLoaderWorkers;
+	bool shuffle;
+	Augmentation augmentation;
 	vector<double> exampleOutputs;
 
 	vector<vector<double>> validationInputs;
+	// 8-bit validation images, one after another, used instead of validationInputs
+	vector<uint8_t> validationPixels;
 	vector<double> validationOutputs;
 
+	/**
+	 * @brief      A convolution or pooling layer with its shapes and buffers. Maps are
+	 *             stored channel by channel, each row by row.
+	 */
+	struct ConvolutionalStage {
+		ConvolutionalLayer layer;
+		size_t inChannels, inRows, inCols;
+		size_t outRows, outCols;
+
+		// convolutions only: one row of inChannels * kernel * kernel weights per output
+		// channel, and the input unrolled so that row r of columns holds the input
+		// under weight r at every output position (im2col)
+		vector<double> weights;
+		vector<double> biases;
+		vector<double> columns;
+		vector<double> columnErrors;
+
+		vector<double> netInputs;
+		vector<double> activations;
+		vector<double> derivatives;
+		// the error of each activation, then of each weighted input
+		vector<double> errors;
+		// max pooling only: the input each output was taken from
+		vector<size_t> sources;
+
+		ConvolutionalStage(const ConvolutionalLayer & layer, size_t inChannels, size_t inRows, size_t inCols);
+	};
+
+	vector<ConvolutionalStage> convolution;
+	// the normalized image, read by the first convolutional stage
+	vector<double> imageInputs;
+
+	// sparse input path: the first hidden layer's weights are stored as
+	// weights[i] + sparseShifts[j], where the shift absorbs the update every weight of
+	// node j receives from the background value, and sparseRowSums[j] is the sum of
+	// the actual weights
+	bool sparseInput;
+	SparseImages validationSparse;
+	vector<double> sparseShifts;
+	vector<double> sparseRowSums;
+	// the current example's nonzero pixels, set instead of currentPixels
+	const uint16_t * currentIndices;
+	const uint8_t * currentValues;
+	size_t currentNonzeros;
+	// the current example's nonzero inputs minus the background, and their sum
+	vector<double> sparseInputs;
+	double sparseInputSum;
+
+	// online SGD: during an epoch the first hidden layer's update is left to the next
+	// forwardPropagate(), which applies it in the same pass over each row that computes
+	// the weighted inputs; pendingInputs are the inputs of the example it is for
+	bool fusingFirstLayer;
+	bool firstLayerPending;
+	double pendingAlpha;
+	vector<double> pendingInputs;
+
 	mt19937 generator;
 	uniform_real_distribution<double> distribution;
 
@@ -136,29 +727,65 @@ private:
 	double valAccuracy;
 	double valLoss;
 
+	// early stopping variables
+	EarlyStopping earlyStopping;
+	double bestValLoss;
+	unsigned epochsSinceImprovement;
+	bool hasStoppedEarly;
+
 	/**
 	 * @brief      Do training one time for all training examples.
 	 */
 	void trainSingleEpoch();
 
 	/**
-	 * @brief      The activation function.
+	 * @brief      Train on the current example and add it to the totals.
+	 */
+	void trainCurrentExample();
+
+	/**
+	 * @brief      Train and validate a single epoch, then update the early stopping state.
+	 */
+	void trainAndValidateSingleEpoch();
+
+	/**
+	 * @brief      Forget the best validation loss seen so far.
+	 */
+	void resetEarlyStopping();
+
+	/**
+	 * @brief      Calculate the derivative of an activation function for a whole layer.
+	 *
+	 * @param[in]  activation  The activation function
+	 * @param[in]  x           The weighted inputs
+	 * @param[in]  y           The activations
+	 * @param[out] dy          The derivative of each activation with respect to its input
+	 * @param[in]  n           The number of nodes in the layer
+	 */
+	static void derivative(Activation activation, const double * x, const double * y, double * dy, size_t n);
+	/**
+	 * @brief      Calculate the input, including the node's bias
 	 *
-	 * @param[in]  x     Input
+	 * @param[in]  prevActivations  The activations of the previous layer
+	 * @param[in]  currLayerNode    The current node in the layer
 	 *
-	 * @return     Activation
+	 * @return     The weighted input for currLayerNode
 	 */
-	static double g(double x);
-	static double gprime(double y);
+	static double in(const double * prevActivations, const Node & currLayerNode);
 	/**
-	 * @brief      Calculate the input 
+	 * @brief      Apply the pending update to a node of the first hidden layer and
+	 *             calculate its input, in one pass over its weights.
 	 *
-	 * @param[in]  layerIterator  Iterator to the current layer
-	 * @param[in]  currLayerNode  The current node in the layer
+	 * @param[in]  prevActivations  The activations of the input layer
+	 * @param      currLayerNode    The node in the first hidden layer
 	 *
 	 * @return     The weighted input for currLayerNode
 	 */
-	static double in(vector<Layer>::iterator currLayerIterator, const Node & currLayerNode);
+	double updateAndIn(const double * prevActivations, Node & currLayerNode);
+	/**
+	 * @brief      Apply the first hidden layer's pending update, if any.
+	 */
+	void applyPendingUpdate();
 
 	/**
 	 * @brief      Print output layer
@@ -189,23 +816,145 @@ private:
 	double randWeight();
 
 	/**
-	 * @brief      Initialize every weight in the network to the value returned by
-	 *             randWeight().
+	 * @brief      Initialize every weight in the network according to its layer's
+	 *             #WeightInit and set every bias to 0. Apart from Uniform, each layer is
+	 *             filled in bulk from a counter-based stream keyed by the seed and layer.
 	 */
 	void initWeights();
 
+	/**
+	 * @brief      Copy everything forwardPropagate() reads into a network with the same
+	 *             topology.
+	 *
+	 * @param[out] replica  The copy
+	 */
+	void copyParametersTo(NeuralNetwork & replica) const;
+
+	/**
+	 * @brief      Point a network at one of this network's validation examples.
+	 *
+	 * @param[out] worker   The network that will propagate the example
+	 * @param[in]  example  The index of the example
+	 */
+	void selectValidationExample(NeuralNetwork & worker, size_t example) const;
+
+	/**
+	 * @brief      Validate one thread's chunks of the validation set with a network
+	 *             holding this network's parameters, adding up its loss and correct
+	 *             predictions.
+	 *
+	 * @param[in]  worker  This network or one of its #replicas
+	 * @param[in]  w       The thread's index, 0 for the calling thread
+	 */
+	void validateChunks(NeuralNetwork & worker, unsigned w);
+
+	/**
+	 * @brief      Run one of the other validation threads until
+	 *             stopValidationThreads(), validating with replica r in each round.
+	 *
+	 * @param[in]  r     The index of the thread's replica
+	 */
+	void validationThread(unsigned r);
+
+	/**
+	 * @brief      Stop and join the validation threads.
+	 */
+	void stopValidationThreads();
+
+	/**
+	 * @brief      Copy each layer's weights into #layerWeights for batchForwardPropagate().
+	 */
+	void gatherLayerWeights();
+
+	/**
+	 * @brief      Propagate the examples in the first rows of #batchActivations through
+	 *             the fully connected layers with gemm(), as forwardPropagate() does
+	 *             outside training.
+	 *
+	 * @param[in]  count  The number of examples, at most VALIDATION_CHUNK
+	 */
+	void batchForwardPropagate(size_t count);
+
+	/**
+	 * @return     The number of pixels in each image.
+	 */
+	size_t imageSize();
+
+	/**
+	 * @brief      Run the convolutional stages on #imageInputs, writing the last one's
+	 *             output to the input layer.
+	 */
+	void convolutionForward();
+	/**
+	 * @brief      Propagate the input layer's errors back through the convolutional
+	 *             stages, updating their weights with SGD on the way.
+	 */
+	void convolutionBackward();
+
+	/**
+	 * @brief      Fold the sparse input path's shifts into the first hidden layer's
+	 *             weights and recompute their sums, so the weights hold their actual
+	 *             values and rounding in the sums does not build up.
+	 */
+	void materializeSparseWeights();
+
+	/**
+	 * @brief      Calculate the first hidden layer's weighted inputs from the current
+	 *             example's nonzero pixels.
+	 */
+	void sparseForwardPropagate();
+	/**
+	 * @brief      Update the first hidden layer's weights from the current example's
+	 *             nonzero pixels with SGD.
+	 */
+	void sparseUpdateWeights();
+
 	/**
 	 * @brief      Perform forward propagation on the network.
+	 *
+	 * @param[in]  training  Should dropout be applied?
 	 */
-	void forwardPropagate();
+	void forwardPropagate(bool training = false);
+
 	/**
-	 * @brief      Perform backward propagation on the network.
+	 * @brief      Apply a layer's batch normalization to its weighted inputs.
+	 *
+	 * @param[in]  layer     The layer
+	 * @param[in]  training  Should the running mean and variance be updated?
+	 */
+	void batchNormalize(vector<Layer>::size_type layer, bool training);
+
+	/**
+	 * @brief      The activations read by a layer, which are masked by dropout while
+	 *             training.
+	 *
+	 * @param[in]  layer     The layer reading the activations, at least 1
+	 * @param[in]  training  Is the network training?
+	 *
+	 * @return     The previous layer's activations.
+	 */
+	const double * layerInputs(vector<Layer>::size_type layer, bool training);
+	/**
+	 * @brief      Perform backward propagation on the network, updating each layer's
+	 *             weights with the #optimizer in the same pass that propagates its
+	 *             errors to the previous layer.
 	 */
 	void backwardPropagate();
 	/**
-	 * @brief      Update every weight in the network using the calculated errors.
+	 * @brief      Update the weights of a layer using its errors and the #optimizer.
+	 *
+	 * @param[in]  l         The layer
+	 * @param[in]  stepSize  The step size for Adam
+	 * @param[in]  epsilon   The epsilon for RMSProp and Adam
+	 * @param      sums      If not null, the previous layer's error sums, to which each
+	 *                       weight times its node's error is added before the update
+	 */
+	void updateLayer(vector<Layer>::size_type l, double stepSize, double epsilon, double * sums);
+
+	/**
+	 * @brief      Allocate and zero the optimizer state needed by the #optimizer.
 	 */
-	void updateWeights();
+	void resetOptimizerState();
 
 	/**
 	 * @brief      Gets the label predicted by the output node(s).
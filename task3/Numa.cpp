@@ -0,0 +1,125 @@
+#include "Numa.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * @brief      Parse a Linux CPU list such as "0-3,8-11".
+ */
+static vector<int> parseCpuList(const string & list) {
+	vector<int> cpus;
+	istringstream ranges(list);
+	string range;
+	while (getline(ranges, range, ',')) {
+		size_t dash = range.find('-');
+		try {
+			int first = stoi(range.substr(0, dash));
+			int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+			for (int cpu = first; cpu <= last; ++cpu) {
+				cpus.push_back(cpu);
+			}
+		} catch (const exception &) {
+			// an empty node has an empty list
+		}
+	}
+	return cpus;
+}
+
+vector<vector<int>> numaNodes() {
+	vector<vector<int>> nodes;
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	// node numbers can have gaps, so look a little past the last one found
+	for (int node = 0, missing = 0; missing < 64; ++node) {
+		ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		string list;
+		if (!getline(file, list)) {
+			++missing;
+			continue;
+		}
+		missing = 0;
+
+		vector<int> cpus;
+		for (int cpu : parseCpuList(list)) {
+			if (!haveMask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))) {
+				cpus.push_back(cpu);
+			}
+		}
+		if (!cpus.empty()) {
+			nodes.push_back(cpus);
+		}
+	}
+	if (nodes.empty() && haveMask) {
+		nodes.push_back(vector<int>());
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &allowed)) {
+				nodes[0].push_back(cpu);
+			}
+		}
+	}
+#endif
+	if (nodes.empty()) {
+		nodes.push_back(vector<int>());
+		for (unsigned cpu = 0; cpu < max(thread::hardware_concurrency(), 1u); ++cpu) {
+			nodes[0].push_back((int)cpu);
+		}
+	}
+	return nodes;
+}
+
+vector<int> spreadCpus(size_t n) {
+	vector<vector<int>> nodes = numaNodes();
+	int callingCpu = -1;
+#ifdef __linux__
+	callingCpu = sched_getcpu();
+#endif
+
+	size_t widest = 0;
+	for (const vector<int> & cpus : nodes) {
+		widest = max(widest, cpus.size());
+	}
+
+	// round robin over the nodes, with the calling thread's CPU last
+	vector<int> order;
+	for (size_t i = 0; i < widest; ++i) {
+		for (const vector<int> & cpus : nodes) {
+			if (i < cpus.size() && cpus[i] != callingCpu) {
+				order.push_back(cpus[i]);
+			}
+		}
+	}
+	if (callingCpu >= 0) {
+		order.push_back(callingCpu);
+	}
+
+	vector<int> chosen(n);
+	for (size_t w = 0; w < n; ++w) {
+		chosen[w] = order[w % order.size()];
+	}
+	return chosen;
+}
+
+bool pinThread(int cpu) {
+#ifdef __linux__
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return false;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief      The CPUs this process may run on, grouped by NUMA node (socket), from
+ *             /sys/devices/system/node. Without that, one node with every CPU.
+ *
+ * @return     The CPUs of each node that has any.
+ */
+vector<vector<int>> numaNodes();
+
+/**
+ * @brief      Choose CPUs for worker threads, taking one from each NUMA node in turn so
+ *             the workers spread over every socket, and leaving the calling thread's
+ *             CPU until every other one is taken.
+ *
+ * @param[in]  n     The number of workers
+ *
+ * @return     The CPU of each worker.
+ */
+vector<int> spreadCpus(size_t n);
+
+/**
+ * @brief      Keep the calling thread on a CPU, so the memory it touches first is
+ *             allocated on that CPU's node and stays local.
+ *
+ * @param[in]  cpu   The CPU
+ *
+ * @return     Whether the thread was pinned; always false outside Linux.
+ */
+bool pinThread(int cpu);
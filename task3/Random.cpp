@@ -0,0 +1,19 @@
+#include "Random.h"
+#include <cmath>
+
+constexpr double TWO_PI = 6.28318530717958647692;
+
+void fillUniform(double * out, size_t n, uint64_t key, uint64_t first, double lower, double upper) {
+	double range = upper - lower;
+	for (size_t i = 0; i < n; ++i) {
+		out[i] = lower + range * counterUniform(key, first + i);
+	}
+}
+
+void fillNormal(double * out, size_t n, uint64_t key, uint64_t first, double mean, double stddev) {
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t c = 2 * (first + i);
+		double radius = sqrt(-2.0 * log(counterUniform(key, c)));
+		out[i] = mean + stddev * radius * cos(TWO_PI * counterUniform(key, c + 1));
+	}
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * @brief      Counter-based random numbers: the n-th number of a stream is a pure
+ *             function of the stream's key and n, so there is no state to carry from
+ *             one number to the next. Loops that fill buffers with these can be
+ *             vectorized and split between threads in any order with the same result.
+ *
+ * @param[in]  key      The stream
+ * @param[in]  counter  The position in the stream
+ *
+ * @return     64 random bits.
+ */
+inline uint64_t counterHash(uint64_t key, uint64_t counter) {
+	// splitmix64 finalizer applied to the key-th Weyl sequence
+	uint64_t z = key + (counter + 1) * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * @brief      A uniformly distributed number in (0, 1].
+ *
+ * @param[in]  key      The stream
+ * @param[in]  counter  The position in the stream
+ *
+ * @return     The number.
+ */
+inline double counterUniform(uint64_t key, uint64_t counter) {
+	return ((counterHash(key, counter) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief      Derive the key of an independent stream, e.g. one per layer.
+ *
+ * @param[in]  key    The parent stream
+ * @param[in]  child  The index of the child stream
+ *
+ * @return     The key of the child stream.
+ */
+inline uint64_t childKey(uint64_t key, uint64_t child) {
+	return counterHash(key ^ 0x6A09E667F3BCC909ULL, child);
+}
+
+/**
+ * @brief      Fill a buffer with uniformly distributed numbers.
+ *
+ * @param[out] out    The buffer
+ * @param[in]  n      The number of values to write
+ * @param[in]  key    The stream
+ * @param[in]  first  The position in the stream of out[0]
+ * @param[in]  lower  The lower bound
+ * @param[in]  upper  The upper bound
+ */
+void fillUniform(double * out, size_t n, uint64_t key, uint64_t first, double lower, double upper);
+
+/**
+ * @brief      Fill a buffer with normally distributed numbers (Box-Muller, consuming
+ *             two positions of the stream per value).
+ *
+ * @param[out] out     The buffer
+ * @param[in]  n       The number of values to write
+ * @param[in]  key     The stream
+ * @param[in]  first   The index of out[0], counted in values
+ * @param[in]  mean    The mean
+ * @param[in]  stddev  The standard deviation
+ */
+void fillNormal(double * out, size_t n, uint64_t key, uint64_t first, double mean, double stddev);
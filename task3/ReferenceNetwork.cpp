@@ -0,0 +1,127 @@
+#include "ReferenceNetwork.h"
+#include <cmath>
+
+ReferenceNetwork::ReferenceNetwork(const vector<int> & topology, double alpha, unsigned seed)
+	: alpha(alpha)
+	, currentInput(nullptr)
+	, currentOutput(0.0)
+{
+	mt19937 generator(seed);
+	uniform_real_distribution<double> distribution(-0.5, 0.5);
+
+	for (vector<int>::size_type l = 0; l < topology.size(); ++l) {
+		activations.push_back(vector<double>(topology[l]));
+		errors.push_back(vector<double>(topology[l]));
+		weights.push_back(vector<vector<double>>());
+		if (l == 0) {
+			continue;
+		}
+
+		for (int j = 0; j < topology[l]; ++j) {
+			vector<double> row(topology[l-1]);
+			for (double & weight : row) {
+				do {
+					weight = distribution(generator);
+				} while (weight == 0.0);
+			}
+			weights[l].push_back(row);
+		}
+	}
+}
+
+double ReferenceNetwork::trainEpoch(const vector<vector<double>> & inputs, const vector<double> & outputs) {
+	double totalLoss = 0.0;
+	for (vector<vector<double>>::size_type e = 0; e < inputs.size(); ++e) {
+		currentInput = inputs[e].data();
+		currentOutput = outputs[e];
+
+		forwardPropagate();
+		totalLoss += getLoss();
+		backwardPropagate();
+		updateWeights();
+	}
+	return totalLoss / inputs.size();
+}
+
+double ReferenceNetwork::validate(const vector<vector<double>> & inputs, const vector<double> & outputs) {
+	double totalLoss = 0.0;
+	for (vector<vector<double>>::size_type e = 0; e < inputs.size(); ++e) {
+		currentInput = inputs[e].data();
+		currentOutput = outputs[e];
+
+		forwardPropagate();
+		totalLoss += getLoss();
+	}
+	return totalLoss / inputs.size();
+}
+
+vector<double> ReferenceNetwork::getWeights() const {
+	vector<double> result;
+	for (const vector<vector<double>> & layer : weights) {
+		for (const vector<double> & row : layer) {
+			result.insert(result.end(), row.begin(), row.end());
+		}
+	}
+	return result;
+}
+
+void ReferenceNetwork::forwardPropagate() {
+	for (size_t i = 0; i < activations[0].size(); ++i) {
+		activations[0][i] = currentInput[i];
+	}
+
+	for (size_t l = 1; l < activations.size(); ++l) {
+		for (size_t j = 0; j < activations[l].size(); ++j) {
+			double in = 0.0;
+			for (size_t i = 0; i < activations[l-1].size(); ++i) {
+				in += weights[l][j][i] * activations[l-1][i];
+			}
+			activations[l][j] = 1.0 / (1.0 + exp(-in));
+		}
+	}
+}
+
+void ReferenceNetwork::backwardPropagate() {
+	size_t last = activations.size() - 1;
+	for (size_t j = 0; j < activations[last].size(); ++j) {
+		double a = activations[last][j];
+		errors[last][j] = a * (1 - a) * (y(j) - a);
+	}
+
+	for (size_t l = last - 1; l > 0; --l) {
+		for (size_t i = 0; i < activations[l].size(); ++i) {
+			double sumPrevError = 0.0;
+			for (size_t j = 0; j < activations[l+1].size(); ++j) {
+				sumPrevError += weights[l+1][j][i] * errors[l+1][j];
+			}
+			double a = activations[l][i];
+			errors[l][i] = a * (1 - a) * sumPrevError;
+		}
+	}
+}
+
+void ReferenceNetwork::updateWeights() {
+	for (size_t l = 1; l < activations.size(); ++l) {
+		for (size_t j = 0; j < activations[l].size(); ++j) {
+			for (size_t i = 0; i < activations[l-1].size(); ++i) {
+				weights[l][j][i] += alpha * activations[l-1][i] * errors[l][j];
+			}
+		}
+	}
+}
+
+double ReferenceNetwork::y(size_t i) const {
+	if (activations.back().size() == 1) {
+		return currentOutput / 10.0;
+	}
+	return double(i == (size_t)currentOutput);
+}
+
+double ReferenceNetwork::getLoss() const {
+	double loss = 0.0;
+	for (size_t j = 0; j < activations.back().size(); ++j) {
+		double yioi = y(j) - activations.back()[j];
+		loss += 100.0 * yioi * yioi;
+	}
+	return loss;
+}
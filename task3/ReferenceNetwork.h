@@ -0,0 +1,73 @@
+#pragma once
+#include <random>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief      The original scalar implementation of the network: fully connected
+ *             sigmoid layers without biases, trained with plain SGD one example at a
+ *             time, with each weight drawn uniformly from [-0.5, 0.5]. Kept unoptimized
+ *             as the reference that NeuralNetwork is compared against, so it must not be
+ *             changed to match it.
+ */
+class ReferenceNetwork {
+public:
+	/**
+	 * @brief      Constructs a new reference network.
+	 *
+	 * @param[in]  topology  The number of nodes in each layer, from the input layer to
+	 *                       the output layer. One output means labels are reduced to
+	 *                       ranges, as with ONE_OUTPUT in NeuralNetwork.cpp.
+	 * @param[in]  alpha     The learning rate
+	 * @param[in]  seed      The seed for initializing the weights
+	 */
+	ReferenceNetwork(const vector<int> & topology, double alpha, unsigned seed);
+
+	/**
+	 * @brief      Train one epoch over the examples in order.
+	 *
+	 * @param[in]  inputs   The normalized inputs
+	 * @param[in]  outputs  The labels
+	 *
+	 * @return     The mean training loss.
+	 */
+	double trainEpoch(const vector<vector<double>> & inputs, const vector<double> & outputs);
+
+	/**
+	 * @brief      Validate the network.
+	 *
+	 * @param[in]  inputs   The normalized inputs
+	 * @param[in]  outputs  The labels
+	 *
+	 * @return     The mean validation loss.
+	 */
+	double validate(const vector<vector<double>> & inputs, const vector<double> & outputs);
+
+	/**
+	 * @return     Every weight, layer by layer, one row of the previous layer's width
+	 *             per node.
+	 */
+	vector<double> getWeights() const;
+
+private:
+	double alpha;
+	// activations[l][j], errors[l][j], and weights[l][j][i], the weight from node i in
+	// layer l-1 to node j in layer l
+	vector<vector<double>> activations;
+	vector<vector<double>> errors;
+	vector<vector<vector<double>>> weights;
+
+	const double * currentInput;
+	double currentOutput;
+
+	void forwardPropagate();
+	void backwardPropagate();
+	void updateWeights();
+
+	/**
+	 * @brief      Expected value of output i.
+	 */
+	double y(size_t i) const;
+	double getLoss() const;
+};
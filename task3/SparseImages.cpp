@@ -0,0 +1,31 @@
+#include "SparseImages.h"
+#include <stdexcept>
+#include <limits>
+
+SparseImages::SparseImages()
+	: offsets(1, 0)
+{}
+
+void SparseImages::clear() {
+	offsets.resize(1);
+	indices.clear();
+	values.clear();
+}
+
+void SparseImages::append(const uint8_t * image, size_t n) {
+	if (n > (size_t)numeric_limits<uint16_t>::max() + 1) {
+		throw logic_error("image too large for 16-bit pixel indices");
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (image[i] != 0) {
+			indices.push_back((uint16_t)i);
+			values.push_back(image[i]);
+		}
+	}
+	offsets.push_back((uint32_t)indices.size());
+}
+
+size_t SparseImages::size() const {
+	return offsets.size() - 1;
+}
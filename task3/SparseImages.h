@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief      8-bit images stored as (index, value) pairs of their nonzero pixels,
+ *             one image after another. Most MNIST pixels are background, so this is
+ *             about a fifth of the dense size and lets the first layer skip them.
+ */
+struct SparseImages {
+	/** Image i's pixels are at positions offsets[i] up to offsets[i+1]. */
+	vector<uint32_t> offsets;
+	vector<uint16_t> indices;
+	vector<uint8_t> values;
+
+	SparseImages();
+
+	/**
+	 * @brief      Remove every image, keeping the allocated space.
+	 */
+	void clear();
+
+	/**
+	 * @brief      Compress one image and add it to the end.
+	 *
+	 * @param[in]  image  The dense image
+	 * @param[in]  n      The number of pixels in the image
+	 */
+	void append(const uint8_t * image, size_t n);
+
+	/**
+	 * @return     The number of images.
+	 */
+	size_t size() const;
+};
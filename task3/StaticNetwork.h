@@ -0,0 +1,191 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include "NeuralNetwork.h"
+#include "util.h"
+
+using namespace std;
+
+/**
+ * @brief      The fully connected layers of a StaticNetwork from a layer of width In
+ *             onwards. Each layer's weights are stored input by input, so the weighted
+ *             inputs are accumulated across the whole layer at once.
+ */
+template <int In, int... Rest>
+struct StaticLayers;
+
+template <int In, int Out, int... Rest>
+struct StaticLayers<In, Out, Rest...> {
+	/** weights[i * Out + j] is the weight from input i to node j. */
+	array<double, In * Out> weights;
+	array<double, Out> biases;
+	array<double, Out> activations;
+	NeuralNetwork::Activation activation;
+	StaticLayers<Out, Rest...> next;
+
+	const double * forward(const double * input) {
+		double * x = activations.data();
+		for (int j = 0; j < Out; ++j) {
+			x[j] = biases[j];
+		}
+		// same order of additions per node as NeuralNetwork, so the outputs match
+		for (int i = 0; i < In; ++i) {
+			const double * w = &weights[i * Out];
+			double a = input[i];
+			for (int j = 0; j < Out; ++j) {
+				x[j] += w[j] * a;
+			}
+		}
+		NeuralNetwork::activate(activation, x, x, Out);
+		return next.forward(x);
+	}
+
+	void readActivations(istream & file) {
+		uint8_t value = 0;
+		file.read((char *)&value, sizeof(value));
+		if (value > (uint8_t)NeuralNetwork::Activation::GELU) {
+			throw runtime_error("checkpoint has an unknown activation function");
+		}
+		activation = (NeuralNetwork::Activation)value;
+		next.readActivations(file);
+	}
+
+	void readWeights(istream & file) {
+		// checkpoints store one row per node
+		array<double, In> row;
+		for (int j = 0; j < Out; ++j) {
+			file.read((char *)&biases[j], sizeof(double));
+			file.read((char *)row.data(), sizeof(row));
+			for (int i = 0; i < In; ++i) {
+				weights[i * Out + j] = row[i];
+			}
+		}
+		next.readWeights(file);
+	}
+};
+
+template <int Out>
+struct StaticLayers<Out> {
+	const double * forward(const double * input) {
+		return input;
+	}
+	void readActivations(istream &) {}
+	void readWeights(istream &) {}
+};
+
+/**
+ * @brief      A fully connected network whose layer widths are compile-time
+ *             constants, e.g. StaticNetwork<784, 32, 32, 32, 10>, for inference only.
+ *             All weights and buffers are arrays inside the object, so predicting never
+ *             allocates and every loop has a constant trip count. Loads the checkpoints
+ *             written by NeuralNetwork::save and gives the same outputs.
+ */
+template <int... Widths>
+class StaticNetwork {
+	static_assert(sizeof...(Widths) >= 2, "a network needs an input and an output layer");
+
+	static constexpr int widths[sizeof...(Widths)] = { Widths... };
+public:
+	static constexpr int nInputs = widths[0];
+	static constexpr int nOutputs = widths[sizeof...(Widths) - 1];
+
+	/**
+	 * @brief      Read the weights from a checkpoint written by NeuralNetwork::save for
+	 *             the same topology.
+	 *
+	 * @param[in]  path  The checkpoint
+	 */
+	void load(const string & path) {
+		ifstream file(path, ios::binary);
+		char magic[sizeof(NeuralNetwork::checkpointMagic)] = {};
+		uint32_t version = 0;
+		uint32_t nLayers = 0;
+		file.read(magic, sizeof(magic));
+		file.read((char *)&version, sizeof(version));
+		file.read((char *)&nLayers, sizeof(nLayers));
+		if (!file || !equal(magic, magic + sizeof(magic), NeuralNetwork::checkpointMagic)
+			|| version != NeuralNetwork::checkpointVersion) {
+			throw runtime_error(path + " is not a checkpoint");
+		}
+		if (nLayers != sizeof...(Widths)) {
+			throw logic_error("checkpoint " + path + " has a different topology");
+		}
+		for (uint32_t l = 0; l < nLayers; ++l) {
+			uint32_t width = 0;
+			file.read((char *)&width, sizeof(width));
+			if (width != (uint32_t)widths[l]) {
+				throw logic_error("checkpoint " + path + " has a different topology");
+			}
+		}
+
+		uint8_t inputActivation = 0;
+		file.read((char *)&inputActivation, sizeof(inputActivation));
+		layers.readActivations(file);
+		layers.readWeights(file);
+		if (!file) {
+			throw runtime_error("checkpoint " + path + " is truncated");
+		}
+	}
+
+	/**
+	 * @brief      Propagate normalized inputs through the network.
+	 *
+	 * @param[in]  input  nInputs normalized inputs
+	 *
+	 * @return     The nOutputs activations of the output layer, valid until the next call.
+	 */
+	const double * forward(const double * input) {
+		return layers.forward(input);
+	}
+
+	/**
+	 * @brief      Predict the label of an 8-bit image.
+	 *
+	 * @param[in]  image  nInputs pixels
+	 *
+	 * @return     The predicted label.
+	 */
+	int predict(const uint8_t * image) {
+		static const array<double, 256> table = normalizedPixels();
+		for (int i = 0; i < nInputs; ++i) {
+			inputs[i] = table[image[i]];
+		}
+		const double * output = forward(inputs.data());
+
+		if (nOutputs == 1) {
+			// the label ranges used with ONE_OUTPUT
+			int label = 0;
+			while (label < 9 && output[0] > (label + 1) / 10.0) {
+				++label;
+			}
+			return label;
+		}
+
+		int label = 0;
+		for (int j = 1; j < nOutputs; ++j) {
+			if (output[j] > output[label]) {
+				label = j;
+			}
+		}
+		return label;
+	}
+
+private:
+	StaticLayers<Widths...> layers;
+	array<double, nInputs> inputs;
+
+	static array<double, 256> normalizedPixels() {
+		array<double, 256> table;
+		for (int value = 0; value < 256; ++value) {
+			table[value] = normalizePixel(value);
+		}
+		return table;
+	}
+};
+
+template <int... Widths>
+constexpr int StaticNetwork<Widths...>::widths[sizeof...(Widths)];
@@ -0,0 +1,110 @@
+#include "SuccessiveHalving.h"
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <iostream>
+#include <iomanip>
+
+using Trial = SuccessiveHalving::Trial;
+
+Trial::Trial(const string & name, unique_ptr<NeuralNetwork> network)
+	: name(name)
+	, network(move(network))
+	, alive(true)
+	, epochs(0)
+{}
+
+SuccessiveHalving::SuccessiveHalving(unsigned minEpochs, unsigned maxEpochs, unsigned eta)
+	: minEpochs(minEpochs)
+	, maxEpochs(maxEpochs)
+	, eta(eta)
+{
+	if (minEpochs == 0 || eta < 2) {
+		throw logic_error("successive halving needs minEpochs > 0 and eta >= 2");
+	}
+}
+
+void SuccessiveHalving::addTrial(const string & name, unique_ptr<NeuralNetwork> network) {
+	trials.push_back(Trial(name, move(network)));
+}
+
+const Trial & SuccessiveHalving::run(int precision) {
+	if (trials.empty()) {
+		throw logic_error("no trials to run");
+	}
+
+	// indices of the trials still competing, best first after each rung
+	vector<vector<Trial>::size_type> ranking;
+	for (vector<Trial>::size_type t = 0; t < trials.size(); ++t) {
+		ranking.push_back(t);
+	}
+
+	unsigned budget = min(minEpochs, maxEpochs);
+	unsigned rung = 0;
+
+	for (;;) {
+		for (auto t : ranking) {
+			NeuralNetwork & nn = *trials[t].network;
+			if (nn.epochsTrained() < budget) {
+				nn.continueTraining(budget - nn.epochsTrained());
+			}
+			trials[t].epochs = nn.epochsTrained();
+		}
+
+		// a diverged trial's loss is NaN, which compares false both ways, so rank those
+		// last explicitly to keep the order strict
+		stable_sort(ranking.begin(), ranking.end(),
+			[this](vector<Trial>::size_type a, vector<Trial>::size_type b) {
+				double lossA = trials[a].network->validationLoss();
+				double lossB = trials[b].network->validationLoss();
+				if (isnan(lossA) || isnan(lossB)) {
+					return !isnan(lossA) && isnan(lossB);
+				}
+				return lossA < lossB;
+			}
+		);
+
+		printRung(++rung, precision);
+
+		if (ranking.size() == 1 || budget >= maxEpochs) {
+			break;
+		}
+
+		// keep the best 1/eta, rounding up so at least one survives
+		auto keep = (ranking.size() + eta - 1) / eta;
+		// the eliminated trials' networks and loader threads are freed right away
+		for (auto r = keep; r < ranking.size(); ++r) {
+			trials[ranking[r]].alive = false;
+			trials[ranking[r]].network.reset();
+		}
+		ranking.resize(keep);
+
+		budget = min(budget * eta, maxEpochs);
+	}
+
+	return trials[ranking.front()];
+}
+
+unsigned SuccessiveHalving::totalEpochs() const {
+	unsigned total = 0;
+	for (const Trial & trial : trials) {
+		total += trial.epochs;
+	}
+	return total;
+}
+
+void SuccessiveHalving::printRung(unsigned rung, int precision) {
+	cout << "rung " << rung << ":" << endl;
+	for (const Trial & trial : trials) {
+		if (!trial.alive) {
+			continue;
+		}
+		cout << setprecision(precision)
+			 << "\t" << trial.name
+			 << "\tepochs: " << trial.network->epochsTrained()
+			 << (trial.network->stoppedEarly() ? " (stopped early)" : "")
+			 << "\tvalAccuracy: " << trial.network->validationAccuracy()
+			 << "\tvalLoss: " << trial.network->validationLoss()
+			 << endl;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "NeuralNetwork.h"
+
+using namespace std;
+
+/**
+ * @brief      Runs a hyperparameter sweep by successive halving. Every trial is
+ *             trained for a small number of epochs, then only the best 1/eta of them
+ *             are given eta times as many epochs, and so on until one remains or the
+ *             epoch budget is exhausted.
+ */
+class SuccessiveHalving {
+public:
+	/**
+	 * @brief      A single configuration in the sweep.
+	 */
+	struct Trial {
+		string name;
+		// released when the trial is eliminated
+		unique_ptr<NeuralNetwork> network;
+		bool alive;
+		// the epochs it was trained for, kept after the network is released
+		unsigned epochs;
+
+		Trial(const string & name, unique_ptr<NeuralNetwork> network);
+	};
+
+	/**
+	 * @brief      Constructs a new scheduler.
+	 *
+	 * @param[in]  minEpochs  The number of epochs every trial gets in the first rung
+	 * @param[in]  maxEpochs  The most epochs any single trial may be trained for
+	 * @param[in]  eta        The reduction factor between rungs
+	 */
+	SuccessiveHalving(unsigned minEpochs, unsigned maxEpochs, unsigned eta = 3);
+
+	/**
+	 * @brief      Add a trial to the sweep.
+	 *
+	 * @param[in]  name     A name used when printing results
+	 * @param[in]  network  The network, which must already be initialized
+	 */
+	void addTrial(const string & name, unique_ptr<NeuralNetwork> network);
+
+	/**
+	 * @brief      Run the sweep, printing a summary of each rung.
+	 *
+	 * @param[in]  precision  The precision for printing the floating point values.
+	 *
+	 * @return     The best trial.
+	 */
+	const Trial & run(int precision = 3);
+
+	/**
+	 * @return     The total number of epochs trained across all trials.
+	 */
+	unsigned totalEpochs() const;
+
+private:
+	unsigned minEpochs;
+	unsigned maxEpochs;
+	unsigned eta;
+
+	vector<Trial> trials;
+
+	/**
+	 * @brief      Print the state of every trial that is still alive.
+	 *
+	 * @param[in]  rung       The rung that just finished
+	 * @param[in]  precision  The precision for printing the floating point values.
+	 */
+	void printRung(unsigned rung, int precision);
+};
@@ -2,9 +2,17 @@
 #include <iostream>
 #include <chrono>
 #include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <random>
 #include "util.h"
 #include "NeuralNetwork.h"
 #include "MNIST_reader.h"
+#include "SuccessiveHalving.h"
+#include "ReferenceNetwork.h"
+#include "StaticNetwork.h"
+#include "Autotune.h"
+#include "AllocationCounter.h"
 
 /* VALIDATION_MODE = 1 => run and print results of validation on each
  * 						  for the validation set
@@ -13,9 +21,95 @@
  */ 
 #define VALIDATION_MODE 1
 
+/* SWEEP_MODE = 1 => ignore VALIDATION_MODE and run a successive halving sweep
+ *					 over SWEEP_ALPHAS x SWEEP_HIDDEN_LAYER_SIZES, printing the
+ *					 survivors of each rung
+ */
+#define SWEEP_MODE 0
+
+/* GRADIENT_CHECK_MODE = 1 => ignore the other modes and compare the gradients of
+ *							   small random networks, with every activation function
+ *							   and layer type, against central differences. Needs no
+ *							   MNIST files and exits with 1 if any relative error is
+ *							   above GRADIENT_TOLERANCE. Built as
+ *							   task3_gradient_check and run by ctest.
+ */
+#ifndef GRADIENT_CHECK_MODE
+#define GRADIENT_CHECK_MODE 0
+#endif
+#define GRADIENT_EPSILON 1e-4
+#define GRADIENT_TOLERANCE 1e-5
+
+/* REGRESSION_MODE = 1 => ignore the other modes and train ReferenceNetwork, the
+ *						   original scalar implementation, next to NeuralNetwork for
+ *						   REGRESSION_EPOCHS epochs from REGRESSION_SEED (fixed, so a
+ *						   failure reproduces) with the settings both support
+ *						   (sigmoid, SGD, Uniform weights, no biases, examples in
+ *						   file order). Prints both losses each epoch and exits with 1
+ *						   if a loss or weight differs by more than REGRESSION_TOLERANCE,
+ *						   where 0 means bitwise. Built as task3_regression and
+ *						   run by ctest.
+ */
+#ifndef REGRESSION_MODE
+#define REGRESSION_MODE 0
+#endif
+#define REGRESSION_EPOCHS 3
+#define REGRESSION_SEED 1570649057
+#define REGRESSION_TOLERANCE 0.0
+/* A BLAS backend adds up validation's weighted inputs in its own order, so with one the
+ * validation losses only have to agree to this relative tolerance. Training does not use
+ * the backend, so the weights and training losses still have to meet
+ * REGRESSION_TOLERANCE. */
+#define REGRESSION_BLAS_TOLERANCE 1e-12
+
+/* GOLDEN_MODE = 1 => ignore the other modes and rerun the Readme's pinned result
+ *					   (3 hidden layers of 32, ALPHA 8e-3, SEED 1570649057, 508
+ *					   epochs, NUM_OUTPUTS outputs) and exit with 1 unless the
+ *					   testing accuracy is GOLDEN_ACCURACY to 3 decimal places.
+ *					   Built as task3_golden and run by ctest.
+ */
+#ifndef GOLDEN_MODE
+#define GOLDEN_MODE 0
+#endif
+#define GOLDEN_SEED 1570649057
+#define GOLDEN_EPOCHS 508
+#define GOLDEN_ACCURACY 0.912
+
+/* ALLOCATION_CHECK_MODE = 1 => set up the network as usual, train one epoch to warm
+ *								 up, then count the heap allocations made while
+ *								 training and validating another epoch. Exits with 1
+ *								 unless there were none, apart from one per extra
+ *								 validation thread started. Needs AllocationCounter.cpp,
+ *								 so it is built as task3_allocation_check instead,
+ *								 and run by ctest.
+ */
+#ifndef ALLOCATION_CHECK_MODE
+#define ALLOCATION_CHECK_MODE 0
+#endif
+
+/* AUTOTUNE_MODE = 1 => set up the network as usual, time every way the portable
+ *						 backend can multiply by each of its layers on this machine,
+ *						 save the fastest to AUTOTUNE_CACHE, and print them.
+ */
+#define AUTOTUNE_MODE 0
+/* The file that keeps the fastest way to multiply by each layer on each CPU, if not
+ * empty. Runs look their layers up in it, timing only the ones that are missing. */
+#define AUTOTUNE_CACHE ""
+
+/* Where to save the trained network, if not empty. */
+#define CHECKPOINT ""
+
+/* STATIC_INFERENCE_MODE = 1 => ignore the other modes, load CHECKPOINT into a
+ *								 ProductionNetwork, and print its testing accuracy
+ *								 and the time taken per image.
+ */
+#define STATIC_INFERENCE_MODE 0
+
 /* How many outputs? If one, make sure to set ONE_OUTPUT to 1 in 
  * NeuralNetwork.cpp. */
+#ifndef NUM_OUTPUTS
 #define NUM_OUTPUTS 1
+#endif
 
 /* Example slicing constants */
 #define NUM_EXAMPLES 6000
@@ -25,24 +119,362 @@
 /* Hyperparameters */
 #define HIDDEN_LAYERS 3
 #define HIDDEN_LAYER_SIZE 32
+/* Layer widths from input to output, e.g. "784-256-64-10". Leave empty to use
+ * HIDDEN_LAYERS layers of HIDDEN_LAYER_SIZE nodes. */
+#define TOPOLOGY ""
+/* Convolution and pooling layers in front of the fully connected layers, e.g.
+ * "conv8k5p2-max2-conv16k5p2-max2" for two 5x5 convolutions with 8 and 16 channels,
+ * each followed by 2x2 max pooling. The input layer then takes their output instead
+ * of the image. Leave empty for a fully connected network. */
+#define CONVOLUTION ""
+#define CONV_ACTIVATION ReLU
+
+/* Activation functions: one of Sigmoid, Tanh, ReLU, LeakyReLU, or GELU. With one
+ * output (ONE_OUTPUT in NeuralNetwork.cpp) the label ranges cover [0, 1], so an output
+ * activation other than Sigmoid can leave them; outputs below 0.1 count as label 0
+ * and outputs above 0.9 as label 9. */
+#define HIDDEN_ACTIVATION Sigmoid
+#define OUTPUT_ACTIVATION Sigmoid
+
+/* Weight initialization: one of Auto, Uniform, XavierUniform, XavierNormal,
+ * HeUniform, or HeNormal. Auto picks Xavier or He from each layer's activation
+ * and fan-in/out. Uniform reproduces results from earlier versions. */
+#define WEIGHT_INIT Auto
+#define USE_BIAS 0
+/* The fraction of each hidden layer's activations dropped on every training example. */
+#define DROPOUT 0.0
+/* Should every hidden layer be batch normalized? Folded away before testing. */
+#define BATCH_NORM 0
 #define ALPHA 8e-3
 #define SEED rd()
 #define EPOCHS 700
 
+/* Optimizer: one of SGD, Momentum, Nesterov, RMSProp, or Adam. BETA1 is the
+ * momentum for Momentum and Nesterov, BETA2 the second moment decay for RMSProp
+ * and Adam. Adam usually wants a smaller ALPHA, around 1e-3. */
+#define OPTIMIZER SGD
+#define BETA1 0.9
+#define BETA2 0.999
+#define EPSILON 1e-8
+
+/* Learning rate schedule: one of Constant, Step, Exponential, Cosine, or OneCycle.
+ * See LearningRateSchedule.h. Lengths are in epochs and may be fractional. */
+#define SCHEDULE Constant
+#define WARMUP_EPOCHS 0
+#define STEP_EPOCHS 100
+#define GAMMA 0.5
+#define MIN_ALPHA_SCALE 0.01
+
+/* Early stopping: PATIENCE = 0 disables the validation loss check, and a
+ * TARGET_ACCURACY above 1 disables the accuracy check */
+#define PATIENCE 0
+#define MIN_DELTA 1e-4
+#define TARGET_ACCURACY 2.0
+
+/* Sweep parameters */
+#define SWEEP_ALPHAS { 2e-3, 4e-3, 8e-3, 16e-3 }
+#define SWEEP_HIDDEN_LAYER_SIZES { 16, 32, 64 }
+#define SWEEP_MIN_EPOCHS 20
+#define SWEEP_ETA 3
+
+/* Batch pipeline: training images are gathered in batches of
+ * BATCH_SIZE on LOADER_THREADS threads, with PREFETCH_BUFFERS batches in flight.
+ * SHUFFLE = 0 keeps the examples in file order. */
+#define BATCH_SIZE 64
+#define PREFETCH_BUFFERS 2
+#define LOADER_THREADS 1
+#define SHUFFLE 1
+
+/* Threads validating each epoch. With DETERMINISTIC 1 the results are bitwise the
+ * same for any number of threads; 0 is slightly faster but can differ in the last
+ * bits between runs. SEED is printed, so pinning it reproduces a run exactly. */
+#define THREADS 1
+#define DETERMINISTIC 1
+/* Should the other validating threads be spread over the NUMA nodes and pinned to
+ * CPUs, each reading its own copy of the network and of its share of the images? */
+#define PIN_THREADS 0
+
+/* Should images be kept as their nonzero pixels, so the first hidden layer skips the
+ * background? Requires the SGD optimizer. */
+#define SPARSE_INPUT 0
+
+/* Augmentation of the training images, all off at 0: random shifts of up to
+ * AUG_SHIFT pixels, rotations of up to AUG_ROTATION degrees, elastic distortion
+ * of up to AUG_ELASTICITY pixels, and noise of up to AUG_NOISE (out of 255). */
+#define AUG_SHIFT 0
+#define AUG_ROTATION 0
+#define AUG_ELASTICITY 0
+#define AUG_NOISE 0
+
 #define PRECISION 4
 
 using Out = double;
 
 using namespace std;
 
+/* The exit code when the MNIST files are missing, which ctest counts as skipped. */
+constexpr int MISSING_DATA = 77;
+
+/* The topology of the model we ship, fixed at compile time for inference. */
+typedef StaticNetwork<784, 32, 32, 32, 10> ProductionNetwork;
+
+#if ALLOCATION_CHECK_MODE
+/**
+ * @brief      Count the heap allocations made by one epoch after a warm-up epoch.
+ *
+ * @param      nn    The initialized network
+ *
+ * @return     The exit code: 0 if the epoch did not allocate, otherwise 1.
+ */
+int checkAllocations(NeuralNetwork & nn) {
+	nn.continueTraining(1);
+
+	startCountingAllocations();
+	nn.continueTraining(1);
+	size_t nAllocations = stopCountingAllocations();
+
+	// the validation threads were started in the warm-up epoch
+	size_t allowed = 0;
+	bool ok = nAllocations <= allowed;
+	cout << "allocations during an epoch: " << nAllocations
+		 << " (allowed " << allowed << ")" << endl
+		 << (ok ? "the epoch did not allocate" : "the epoch allocated") << endl;
+	return ok ? 0 : 1;
+}
+#endif
+
+#if AUTOTUNE_MODE
+/**
+ * @brief      Retune every layer of the network and print the choices.
+ *
+ * @param      nn    The network
+ *
+ * @return     The exit code.
+ */
+int runAutotune(NeuralNetwork & nn) {
+	if (string(AUTOTUNE_CACHE).empty()) {
+		cout << "AUTOTUNE_MODE needs an AUTOTUNE_CACHE to save the results to" << endl;
+		return 1;
+	}
+
+	cout << "tuning for " << hostCpu() << endl;
+	vector<GemmTuning> tunings = nn.autotune(AUTOTUNE_CACHE, true);
+	vector<int> topology = nn.getTopology();
+	for (size_t l = 0; l < tunings.size(); ++l) {
+		cout << "layer " << l + 1 << " (" << topology[l] << " x " << topology[l + 1] << "): "
+			 << tunings[l].rows << " examples at a time, "
+			 << (tunings[l].block ? to_string(tunings[l].block) : string("all")) << " inputs per pass" << endl;
+	}
+	return 0;
+}
+#endif
+
+#if STATIC_INFERENCE_MODE
+/**
+ * @brief      Test CHECKPOINT with a ProductionNetwork.
+ *
+ * @return     The exit code.
+ */
+int runStaticInference() {
+	vector<vector<uint8_t>> testingImages;
+	vector<int> testingLabels;
+	loadMnistImages("../MNIST/t10k-images-idx3-ubyte", testingImages);
+	loadMnistLabels("../MNIST/t10k-labels-idx1-ubyte", testingLabels);
+	if (testingImages.empty() || testingImages[0].size() != ProductionNetwork::nInputs) {
+		cout << "the testing images do not match ProductionNetwork" << endl;
+		return 1;
+	}
+
+	// too large for the stack of every platform
+	static ProductionNetwork nn;
+	nn.load(CHECKPOINT);
+
+	int correct = 0;
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < testingImages.size(); ++i) {
+		if (nn.predict(testingImages[i].data()) == testingLabels[i]) {
+			++correct;
+		}
+	}
+	chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+	cout << "Testing accuracy: " << correct / (double)testingImages.size() << endl
+		 << "time per image: " << elapsed.count() / testingImages.size() << "us" << endl;
+	return 0;
+}
+#endif
+
+#if GRADIENT_CHECK_MODE
+/**
+ * @brief      Check the gradients of 8x8 networks with every activation function as
+ *             dense layers, with biases, dropout, batch normalization, convolution and
+ *             pooling, and the sparse input path, on a random image.
+ *
+ * @return     The exit code: 0 if every check passed, otherwise 1.
+ */
+int checkGradients() {
+	const NeuralNetwork::Activation activations[] = {
+		NeuralNetwork::Activation::Sigmoid, NeuralNetwork::Activation::Tanh,
+		NeuralNetwork::Activation::ReLU, NeuralNetwork::Activation::LeakyReLU,
+		NeuralNetwork::Activation::GELU };
+	const char * activationNames[] = { "Sigmoid", "Tanh", "ReLU", "LeakyReLU", "GELU" };
+	const char * layerNames[] = { "dense", "bias", "dropout", "batch norm", "convolution", "sparse" };
+	const int side = 8;
+	const string convolutionLayers = "conv3k3p1-max2-conv4k3s1p1-avg2";
+
+	// half the pixels are background, like MNIST
+	mt19937 generator(1);
+	vector<uint8_t> image(side * side);
+	for (uint8_t & pixel : image) {
+		pixel = generator() % 2 ? generator() % 256 : 0;
+	}
+	double label = generator() % 10;
+
+	bool passed = true;
+	for (int a = 0; a < 5; ++a) {
+		for (int layers = 0; layers < 6; ++layers) {
+			vector<NeuralNetwork::ConvolutionalLayer> convolution;
+			if (layers == 4) {
+				convolution = NeuralNetwork::parseConvolution(convolutionLayers, activations[a]);
+			}
+			int nInputs = NeuralNetwork::convolutionOutputSize(side, side, convolution);
+
+			NeuralNetwork nn(vector<int>{ nInputs, 12, 10, NUM_OUTPUTS }, layers == 1);
+			nn.setActivations(activations[a], NeuralNetwork::Activation::Sigmoid);
+			nn.setConvolution(side, side, convolution);
+			nn.setDropout(layers == 2 ? 0.25 : 0.0);
+			nn.setBatchNorm(layers == 3);
+			nn.setSparseInput(layers == 5);
+			nn.initialize(1e-2, a * 6 + layers, vector<vector<uint8_t>>(), vector<double>(),
+				vector<vector<uint8_t>>(), vector<double>(), 1);
+
+			double error = nn.checkGradients(image, label, GRADIENT_EPSILON);
+			bool ok = error <= GRADIENT_TOLERANCE;
+			passed = passed && ok;
+			cout << scientific << setprecision(2)
+				 << activationNames[a] << " " << layerNames[layers]
+				 << ": worst relative error " << error << (ok ? "" : " FAILED") << endl;
+		}
+	}
+	cout << (passed ? "all gradients match" : "gradient check failed") << endl;
+	return passed ? 0 : 1;
+}
+#endif
+
+#if REGRESSION_MODE
+/**
+ * @brief      Train the reference and optimized networks side by side and compare
+ *             their losses and weights after every epoch.
+ *
+ * @return     The exit code: 0 if they matched, otherwise 1.
+ */
+int compareWithReference
+		( const vector<vector<uint8_t>> & trainingImages
+		, const vector<double> & trainingLabels
+		, const vector<vector<uint8_t>> & validationImages
+		, const vector<double> & validationLabels
+		, unsigned seed )
+{
+	vector<int> topology = NeuralNetwork::uniformTopology(trainingImages[0].size(), HIDDEN_LAYERS, HIDDEN_LAYER_SIZE, NUM_OUTPUTS);
+	vector<vector<double>> trainingInputs = normalizeImages(trainingImages);
+	vector<vector<double>> validationInputs = normalizeImages(validationImages);
+
+	ReferenceNetwork reference(topology, ALPHA, seed);
+
+	NeuralNetwork nn(topology);
+	nn.setWeightInit(NeuralNetwork::WeightInit::Uniform);
+	nn.setBatchPipeline(BATCH_SIZE, PREFETCH_BUFFERS, LOADER_THREADS, false);
+	nn.initialize(ALPHA, seed, trainingImages, trainingLabels, validationImages, validationLabels, REGRESSION_EPOCHS);
+
+	bool matched = true;
+	cout << scientific << setprecision(17);
+	for (int epoch = 1; epoch <= REGRESSION_EPOCHS; ++epoch) {
+		double referenceTrainLoss = reference.trainEpoch(trainingInputs, trainingLabels);
+		double referenceValLoss = reference.validate(validationInputs, validationLabels);
+		nn.continueTraining(1);
+
+		vector<double> referenceWeights = reference.getWeights();
+		vector<double> weights = nn.getWeights();
+		double weightDifference = 0.0;
+		for (size_t i = 0; i < weights.size(); ++i) {
+			weightDifference = max(weightDifference, fabs(weights[i] - referenceWeights[i]));
+		}
+#ifdef USE_CBLAS
+		double valTolerance = max(REGRESSION_TOLERANCE, REGRESSION_BLAS_TOLERANCE * fabs(referenceValLoss));
+#else
+		double valTolerance = REGRESSION_TOLERANCE;
+#endif
+		bool ok = weightDifference <= REGRESSION_TOLERANCE
+			&& fabs(nn.trainingLoss() - referenceTrainLoss) <= REGRESSION_TOLERANCE
+			&& fabs(nn.validationLoss() - referenceValLoss) <= valTolerance;
+		matched = matched && ok;
+
+		cout << "epoch: " << epoch << endl
+			 << "\treference trainLoss: " << referenceTrainLoss << ", valLoss: " << referenceValLoss << endl
+			 << "\toptimized trainLoss: " << nn.trainingLoss() << ", valLoss: " << nn.validationLoss() << endl
+			 << "\tlargest weight difference: " << weightDifference << (ok ? "" : " MISMATCH") << endl;
+	}
+	cout << (matched ? "optimized network matches the reference" : "optimized network differs from the reference") << endl;
+	return matched ? 0 : 1;
+}
+#endif
+
+#if GOLDEN_MODE
+/**
+ * @brief      Rerun the Readme's pinned result and test it.
+ *
+ * @return     The exit code: 0 if the testing accuracy matched, otherwise 1.
+ */
+int runGolden
+		( const vector<vector<uint8_t>> & trainingImages
+		, const vector<double> & trainingLabels
+		, const vector<vector<uint8_t>> & validationImages
+		, const vector<double> & validationLabels )
+{
+	vector<vector<uint8_t>> testingImages;
+	vector<int> testingLabels;
+	loadMnistImages("../MNIST/t10k-images-idx3-ubyte", testingImages);
+	loadMnistLabels("../MNIST/t10k-labels-idx1-ubyte", testingLabels);
+	if (testingImages.empty() || testingLabels.empty()) {
+		cout << "could not load the MNIST testing set" << endl;
+		return MISSING_DATA;
+	}
+
+	NeuralNetwork nn(NeuralNetwork::uniformTopology(trainingImages[0].size(), 3, 32, NUM_OUTPUTS));
+	nn.setWeightInit(NeuralNetwork::WeightInit::Uniform);
+	nn.setBatchPipeline(BATCH_SIZE, PREFETCH_BUFFERS, LOADER_THREADS, false);
+	nn.initialize(8e-3, GOLDEN_SEED, trainingImages, trainingLabels, validationImages, validationLabels, GOLDEN_EPOCHS);
+	nn.train();
+
+	nn.initialize(8e-3, GOLDEN_SEED, vector<vector<uint8_t>>(), vector<double>(),
+		testingImages, vector<double>(testingLabels.begin(), testingLabels.end()), GOLDEN_EPOCHS, false);
+	nn.validate();
+	nn.showValidationResult(3);
+
+	bool matched = fabs(nn.validationAccuracy() - GOLDEN_ACCURACY) < 5e-4;
+	cout << (matched ? "golden result reproduced" : "golden result NOT reproduced") << endl;
+	return matched ? 0 : 1;
+}
+#endif
+
 int main()
 {
+#if GRADIENT_CHECK_MODE
+	return checkGradients();
+#elif STATIC_INFERENCE_MODE
+	return runStaticInference();
+#endif
+
 	cout << fixed;
 
 	string filename = "../MNIST/train-images.idx3-ubyte";
 	//load MNIST images
-	vector <vector< int> > training_images;
+	vector <vector< uint8_t> > training_images;
 	loadMnistImages(filename, training_images);
+	if (training_images.empty()) {
+		cout << "could not load " << filename << endl;
+		return MISSING_DATA;
+	}
 	cout << "Number of images: " << training_images.size() << endl;
 	cout << "Image size: " << training_images[0].size() << endl;
 
@@ -52,18 +484,21 @@ int main()
 	//load MNIST labels
 	vector<int> training_labels;
 	loadMnistLabels(filename, training_labels);
+	if (training_labels.empty()) {
+		cout << "could not load " << filename << endl;
+		return MISSING_DATA;
+	}
 	cout << "Number of labels: " << training_labels.size() << endl;
 
-	// slice and normalize
-	vector<vector<int>> image_slice(training_images.begin(), training_images.begin() + NUM_EXAMPLES);
+	// slice. The images stay 8-bit and are normalized as they enter the network.
+	vector<vector<uint8_t>> image_slice(training_images.begin(), training_images.begin() + NUM_EXAMPLES);
 	vector<Out> label_slice(training_labels.begin(), training_labels.begin() + NUM_EXAMPLES);
-	auto normalized_images = normalizeImages<int>(image_slice);
 
 	// slice training and validation
-	vector<vector<double>> training_image_slice(normalized_images.begin(), normalized_images.begin() + NUM_TRAINING);
+	vector<vector<uint8_t>> training_image_slice(image_slice.begin(), image_slice.begin() + NUM_TRAINING);
 	vector<Out> training_label_slice(label_slice.begin(), label_slice.begin() + NUM_TRAINING);
 	
-	vector<vector<double>> validation_image_slice(normalized_images.begin() + NUM_TRAINING, normalized_images.begin() + NUM_TRAINING + NUM_VALIDATION);
+	vector<vector<uint8_t>> validation_image_slice(image_slice.begin() + NUM_TRAINING, image_slice.begin() + NUM_TRAINING + NUM_VALIDATION);
 	vector<Out> validation_label_slice(label_slice.begin() + NUM_TRAINING, label_slice.begin() + NUM_TRAINING + NUM_VALIDATION);
 
 	// print info for debug
@@ -72,12 +507,101 @@ int main()
 		 << "num training labels: " << training_label_slice.size() << endl
 		 << "num validation labels: " << validation_label_slice.size() << endl;
 
+#if REGRESSION_MODE
+	unsigned seed = REGRESSION_SEED;
+#elif GOLDEN_MODE
+	unsigned seed = GOLDEN_SEED;
+#else
 	random_device rd;
 	unsigned seed = SEED;
+#endif
 	cout << "seed: " << seed << endl;
+	cout << "dense layer backend: " << backendName() << endl;
+
+#if REGRESSION_MODE
+	return compareWithReference(training_image_slice, training_label_slice, validation_image_slice, validation_label_slice, seed);
+#elif GOLDEN_MODE
+	return runGolden(training_image_slice, training_label_slice, validation_image_slice, validation_label_slice);
+#endif
+
+	NeuralNetwork::EarlyStopping earlyStopping(PATIENCE, MIN_DELTA, TARGET_ACCURACY);
+	NeuralNetwork::OptimizerSettings optimizer(NeuralNetwork::Optimizer::OPTIMIZER, BETA1, BETA2, EPSILON);
+	Augmentation augmentation(AUG_SHIFT, AUG_ROTATION, AUG_ELASTICITY, AUG_NOISE);
+	LearningRateSchedule schedule(LearningRateSchedule::Type::SCHEDULE, WARMUP_EPOCHS, STEP_EPOCHS, GAMMA, MIN_ALPHA_SCALE);
+
+	// MNIST images are square
+	int side = lround(sqrt(training_images[0].size()));
+	vector<NeuralNetwork::ConvolutionalLayer> convolution
+		= NeuralNetwork::parseConvolution(CONVOLUTION, NeuralNetwork::Activation::CONV_ACTIVATION);
+	int nInputs = NeuralNetwork::convolutionOutputSize(side, side, convolution);
+
+#if SWEEP_MODE
+	SuccessiveHalving sweep(SWEEP_MIN_EPOCHS, EPOCHS, SWEEP_ETA);
+	for (double alpha : SWEEP_ALPHAS) {
+		for (int hiddenLayerSize : SWEEP_HIDDEN_LAYER_SIZES) {
+			unique_ptr<NeuralNetwork> trial(new NeuralNetwork(nInputs, HIDDEN_LAYERS, hiddenLayerSize, NUM_OUTPUTS, USE_BIAS));
+			trial->setActivations(NeuralNetwork::Activation::HIDDEN_ACTIVATION, NeuralNetwork::Activation::OUTPUT_ACTIVATION);
+			trial->setWeightInit(NeuralNetwork::WeightInit::WEIGHT_INIT);
+			trial->setEarlyStopping(earlyStopping);
+			trial->setBatchPipeline(BATCH_SIZE, PREFETCH_BUFFERS, LOADER_THREADS, SHUFFLE);
+			trial->setAugmentation(augmentation);
+			trial->setSparseInput(SPARSE_INPUT);
+			trial->setConvolution(side, side, convolution);
+			trial->setDropout(DROPOUT);
+			trial->setBatchNorm(BATCH_NORM);
+			trial->setThreads(THREADS, DETERMINISTIC, PIN_THREADS);
+			if (!string(AUTOTUNE_CACHE).empty()) {
+				trial->autotune(AUTOTUNE_CACHE);
+			}
+			trial->setOptimizer(optimizer);
+			trial->setLearningRateSchedule(schedule);
+			trial->initialize
+				( alpha
+				, seed
+				, training_image_slice
+				, training_label_slice
+				, validation_image_slice
+				, validation_label_slice
+				, EPOCHS);
+			sweep.addTrial("alpha=" + to_string(alpha) + " hiddenLayerSize=" + to_string(hiddenLayerSize), move(trial));
+		}
+	}
+
+	const SuccessiveHalving::Trial & best = sweep.run(PRECISION);
+	cout << "best: " << best.name << endl
+		 << "total epochs: " << sweep.totalEpochs() << endl;
+
+	return 0;
+#endif
 
 	// initialize, train, and validate neural network
-	NeuralNetwork nn(training_images[0].size(), HIDDEN_LAYERS, HIDDEN_LAYER_SIZE, NUM_OUTPUTS);
+	vector<int> topology = string(TOPOLOGY).empty()
+		? NeuralNetwork::uniformTopology(nInputs, HIDDEN_LAYERS, HIDDEN_LAYER_SIZE, NUM_OUTPUTS)
+		: NeuralNetwork::parseTopology(TOPOLOGY);
+	if (topology.front() != nInputs || topology.back() != NUM_OUTPUTS) {
+		cout << "topology must start with the image size (or convolution output size) and end with NUM_OUTPUTS" << endl;
+		return 1;
+	}
+
+	NeuralNetwork nn(topology, USE_BIAS);
+	nn.setActivations(NeuralNetwork::Activation::HIDDEN_ACTIVATION, NeuralNetwork::Activation::OUTPUT_ACTIVATION);
+	nn.setWeightInit(NeuralNetwork::WeightInit::WEIGHT_INIT);
+	nn.setEarlyStopping(earlyStopping);
+	nn.setBatchPipeline(BATCH_SIZE, PREFETCH_BUFFERS, LOADER_THREADS, SHUFFLE);
+	nn.setAugmentation(augmentation);
+	nn.setSparseInput(SPARSE_INPUT);
+	nn.setConvolution(side, side, convolution);
+	nn.setDropout(DROPOUT);
+	nn.setBatchNorm(BATCH_NORM);
+	nn.setThreads(THREADS, DETERMINISTIC, PIN_THREADS);
+#if AUTOTUNE_MODE
+	return runAutotune(nn);
+#endif
+	if (!string(AUTOTUNE_CACHE).empty()) {
+		nn.autotune(AUTOTUNE_CACHE);
+	}
+	nn.setOptimizer(optimizer);
+	nn.setLearningRateSchedule(schedule);
 	nn.initialize
 		( ALPHA
 		, seed
@@ -87,11 +611,19 @@ int main()
 		, validation_label_slice // validation labels
 		, EPOCHS);
 
+#if ALLOCATION_CHECK_MODE
+	return checkAllocations(nn);
+#endif
+
 #if VALIDATION_MODE
 	/* trainAndValidate prints the training accuracy, training loss, validation
-	 * accuracy, and validation loss at each epoch.
+	 * accuracy, and validation loss at each epoch, stopping early if the
+	 * PATIENCE or TARGET_ACCURACY criteria are met.
 	 */
 	nn.trainAndValidate(PRECISION);
+	if (!string(CHECKPOINT).empty()) {
+		nn.save(CHECKPOINT);
+	}
 #else
 	/* Given the determined hyperparameters and seed, use this to validate
 	 * them
@@ -102,13 +634,17 @@ int main()
 	nn.validate();
 	cout << "validation (epoch " << EPOCHS << "): " <<endl;
 	nn.showValidationResult(PRECISION);
+	if (!string(CHECKPOINT).empty()) {
+		nn.save(CHECKPOINT);
+	}
 
 
-	/* testing */
+	/* testing, with the batch normalization folded into the weights as when
+	 * exporting the network */
+	nn.foldBatchNorm();
 	filename = "../MNIST/t10k-images-idx3-ubyte";
-	vector <vector< int> > testing_images;
+	vector <vector< uint8_t> > testing_images;
 	loadMnistImages(filename, testing_images);
-	normalized_images = normalizeImages<int>(testing_images);
 	cout << "number of testing images: " << testing_images.size() << endl
 		 << "size of image: " << testing_images[0].size() << endl;
 
@@ -120,9 +656,9 @@ int main()
 	nn.initialize
 		( ALPHA
 		, seed
-		, vector<vector<double>>() // empty
+		, vector<vector<uint8_t>>() // empty
 		, vector<double>() // empty
-		, normalized_images // validation images
+		, testing_images // validation images
 		, vector<double>(testing_labels.begin(), testing_labels.end()) // validation labels
 		, EPOCHS
 		, false // don't reinitialize the weights
@@ -3,13 +3,20 @@
 
 using namespace std;
 
+/**
+ * @brief      The normalized network input for a pixel value.
+ */
+inline double normalizePixel(double val) {
+	return (val - 125.0) / 255.0;
+}
+
 template <typename T>
 vector<vector<double>> normalizeImages(vector<vector<T>> const & training_images) {
 	vector<vector<double>> result;
 	for (vector<T> row : training_images) {
 		result.push_back(vector<double>());
 		for (T val : row) {
-			result.rbegin()->push_back(((double)val - 125.0) / 255.0);
+			result.rbegin()->push_back(normalizePixel((double)val));
 		}
 	}
 	return result;